@@ -3,6 +3,10 @@
 
 #define FOC_LED_GPIO (GPIO_NUM_11)
 
+// RTS/CTS to the stm32, not routed on any board yet
+#define FOC_UART_RTS_GPIO (GPIO_NUM_NC)
+#define FOC_UART_CTS_GPIO (GPIO_NUM_NC)
+
 #if defined(BOARD_FOCSTIM_V4_0)
 #define FOC_I2C_SCL_GPIO (GPIO_NUM_7)
 #define FOC_I2C_SDA_GPIO (GPIO_NUM_1)
@@ -0,0 +1,48 @@
+#include "boot_time.h"
+
+#include <stdbool.h>
+#include "esp_timer.h"
+
+#include "control.h"
+
+typedef struct {
+    const char *phase;
+    int64_t time;
+} boot_phase_t;
+
+static boot_phase_t phases[BOOT_TIME_MAX_PHASES];
+static int num_phases = 0;
+
+
+void boot_time_mark(const char *phase)
+{
+    int64_t now = esp_timer_get_time();
+    // may be called from any task
+    int i = __atomic_fetch_add(&num_phases, 1, __ATOMIC_RELAXED);
+    if (i >= BOOT_TIME_MAX_PHASES) {
+        return;
+    }
+    phases[i].time = now;
+    __atomic_store_n(&phases[i].phase, phase, __ATOMIC_RELEASE);
+}
+
+static void boot_command(int fd, int argc, char **argv)
+{
+    int64_t last = 0;
+    for (int i = 0; i < BOOT_TIME_MAX_PHASES; i++) {
+        const char *phase = __atomic_load_n(&phases[i].phase, __ATOMIC_ACQUIRE);
+        if (phase == NULL) {
+            continue;
+        }
+        // and the time since the entry before
+        int64_t delta = phases[i].time - last;
+        control_printf(fd, "%8lu.%03lums %+8ldms  %s\n", (unsigned long)(phases[i].time / 1000),
+            (unsigned long)(phases[i].time % 1000), (long)(delta / 1000), phase);
+        last = phases[i].time;
+    }
+}
+
+void boot_time_init(void)
+{
+    control_register("boot", "startup phase timestamps", boot_command);
+}
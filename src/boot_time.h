@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+
+// Timestamps of the startup phases, to see where cold boot time goes.
+//
+// Each phase is stamped with esp_timer_get_time() when it is done, which counts from early
+// in the startup code, so "app_main" is roughly the bootloader and IDF startup. The first
+// byte forwarded in each direction is stamped too. "boot" on the control port lists them.
+
+#define BOOT_TIME_MAX_PHASES    16
+
+// record that `phase` (a string literal) finished now, ignored once the table is full
+void boot_time_mark(const char *phase);
+
+// registers the "boot" control command
+void boot_time_init(void);
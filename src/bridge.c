@@ -0,0 +1,138 @@
+#include "bridge.h"
+
+#include <stdio.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+#include "esp_log.h"
+
+#include "usb_serial.h"
+#include "uart.h"
+#include "tcp_server.h"
+#include "udp_server.h"
+#include "schedule.h"
+#include "timesync.h"
+#include "stm32_flash.h"
+#include "fanout.h"
+#include "latency.h"
+#include "control.h"
+#include "mux.h"
+#include "stats.h"
+#include "power.h"
+#include "tasks.h"
+#include "boot_time.h"
+
+
+static fanout_t *usb_serial_rx;
+static fanout_reader_t *usb_serial_tx;
+
+static fanout_t *stm_serial_rx;
+static fanout_t *stm_serial_tx[MUX_NUM_LANES];
+static fanout_reader_t *uart_tx[MUX_NUM_LANES];
+
+static fanout_t *tcp_rx[TCP_MAX_CLIENTS];
+static fanout_reader_t *tcp_tx[TCP_MAX_CLIENTS];
+
+static fanout_t *udp_rx;
+static fanout_reader_t *udp_tx;
+
+static fanout_t *schedule_out;
+
+#if BRIDGE_EVENT_LOOP
+#define LOOP_STACK_SIZE     (4096)
+// the loop also runs this often without events, for what has no notification:
+// an unfinished mux frame timing out, a USB host that is slow to read, credits to grant.
+#define LOOP_POLL_MS        10
+
+static void bridge_loop_task(void *pvParameters)
+{
+    while (1) {
+        // host -> stm32, then stm32 -> usb. Network clients are served by their own tasks.
+        bool busy = mux_poll() > 0;
+        busy |= uart_poll_tx();
+        busy |= usb_serial_poll_tx();
+
+        uart_poll_rx(busy ? 0 : pdMS_TO_TICKS(LOOP_POLL_MS));
+    }
+}
+#endif
+
+
+void bridge_start(void)
+{
+    latency_init();
+    tasks_init();
+    fanout_init();
+    stats_init();
+    power_init();
+    timesync_init();
+    boot_time_init();
+
+    //Create buffers
+    usb_serial_rx = fanout_create("usb_rx", 1024);
+    // host -> stm32 lanes: small urgent frames, and everything else. The bulk lane can take
+    // a whole parameter upload, the uart only hands a bounded part of it to the driver.
+    stm_serial_tx[MUX_LANE_URGENT] = fanout_create("stm_tx_urgent", 512);
+    stm_serial_tx[MUX_LANE_BULK] = fanout_create("stm_tx", 4096);
+    uart_tx[MUX_LANE_URGENT] = fanout_add_reader(stm_serial_tx[MUX_LANE_URGENT], "uart_urgent");
+    uart_tx[MUX_LANE_BULK] = fanout_add_reader(stm_serial_tx[MUX_LANE_BULK], "uart_tx");
+
+    // all bytes from the stm32 are written once and read by the USB serial sink and every network client.
+    // Only the wired USB sink may hold up the uart, network clients that fall behind lose data instead.
+    stm_serial_rx = fanout_create("stm_rx", 16384);
+    assert(stm_serial_rx);
+    usb_serial_tx = fanout_add_reader(stm_serial_rx, "usb_tx");
+    assert(usb_serial_rx);
+    assert(usb_serial_tx);
+    assert(uart_tx[MUX_LANE_URGENT]);
+    assert(uart_tx[MUX_LANE_BULK]);
+
+    // readers are registered by the mux, start it before the producers.
+    // USB serial and network clients may talk to the stm32 at the same time, whole frames at a time.
+    mux_add_source(usb_serial_rx, "usb", LATENCY_USB_RX_QUEUE);
+    for (int i = 0; i < TCP_MAX_CLIENTS; i++) {
+        static char names[TCP_MAX_CLIENTS][3][8];
+        snprintf(names[i][0], sizeof(names[i][0]), "tcp%d", i);
+        snprintf(names[i][1], sizeof(names[i][1]), "tcp%d_rx", i);
+        snprintf(names[i][2], sizeof(names[i][2]), "tcp%d_tx", i);
+        tcp_rx[i] = fanout_create(names[i][1], 512);
+        tcp_tx[i] = fanout_add_reader(stm_serial_rx, names[i][2]);
+        assert(tcp_rx[i]);
+        assert(tcp_tx[i]);
+        fanout_reader_set_policy(tcp_tx[i], FANOUT_DROP_OLDEST, 0);
+        mux_add_source(tcp_rx[i], names[i][0], LATENCY_TCP_RX_QUEUE);
+    }
+    udp_rx = fanout_create("udp_rx", 1024);
+    udp_tx = fanout_add_reader(stm_serial_rx, "udp_tx");
+    assert(udp_rx);
+    assert(udp_tx);
+    fanout_reader_set_policy(udp_tx, FANOUT_DROP_OLDEST, 0);
+    mux_add_source(udp_rx, "udp", LATENCY_UDP_RX_QUEUE);
+    // timed commands are released when due, they must not wait behind bulk data.
+    schedule_out = fanout_create("sched_rx", 1024);
+    assert(schedule_out);
+    mux_add_source(schedule_out, "sched", LATENCY_SCHEDULE_QUEUE);
+    mux_set_source_urgent("sched", true);
+
+#if BRIDGE_EVENT_LOOP
+    uart_init_polled(stm_serial_rx, uart_tx);
+    usb_serial_init_polled(usb_serial_rx, usb_serial_tx);
+    mux_init_polled(stm_serial_tx, MUX_DELIMITER, uart_wake, NULL);
+    task_create(bridge_loop_task, "bridge", LOOP_STACK_SIZE, NULL, 10);
+#else
+    create_mux_task(stm_serial_tx, MUX_DELIMITER);
+
+    create_stm32_serial_task(stm_serial_rx, uart_tx);
+    create_usb_serial_task(usb_serial_rx, usb_serial_tx);
+#endif
+}
+
+void bridge_start_network(void)
+{
+    power_wifi_started();
+    create_tcp_server_task(tcp_rx, tcp_tx);
+    create_udp_server_task(udp_rx, udp_tx);
+    create_schedule_task(schedule_out);
+    create_stm32_flash_task();
+    create_control_server_task();
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+// Routing core of the bridge: creates the buffers between the STM32 UART,
+// USB serial and network endpoints and starts the tasks that move bytes between them.
+// Independent of the board, so it also builds for the ESP-IDF linux target.
+
+// Bridge engine, chosen at compile time (e.g. build_flags = -DBRIDGE_EVENT_LOOP=1):
+// 0: every endpoint and the mux run in their own task, data crosses a task switch at each hop.
+// 1: one event loop task drives the mux, UART rx/tx and USB tx. It sleeps on the UART driver
+//    event queue, which the other producers poke through uart_wake(). Less stack and no task
+//    switches between the STM32 and USB. USB rx keeps a task since its driver can't notify.
+// Routing, buffers and the network endpoints are the same in both.
+#ifndef BRIDGE_EVENT_LOOP
+#define BRIDGE_EVENT_LOOP 0
+#endif
+
+// create all buffers and start the USB serial <-> STM32 path.
+void bridge_start(void);
+
+// start the TCP and UDP endpoints and the control port. Requires the network stack to be initialized.
+void bridge_start_network(void);
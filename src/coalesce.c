@@ -0,0 +1,145 @@
+#include "coalesce.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+
+#include "control.h"
+#include "uart.h"
+
+// default stm32 link backlog to release frames into, microseconds
+#define COALESCE_BACKLOG_US     5000
+
+typedef struct {
+    uint8_t data[COALESCE_MAX_FRAME_LEN];
+    uint16_t len;
+    bool keyed;
+    uint32_t timestamp;
+} coalesce_frame_t;
+
+// pending frames in arrival order, a ring of `count` frames starting at `head`.
+// Only touched by the mux.
+static coalesce_frame_t frames[COALESCE_MAX_FRAMES];
+static int head = 0;
+static int count = 0;
+
+static volatile bool enabled = false;
+// offset << 16 | length, one word so the mux never sees a mixed pair
+static volatile uint32_t key = 1;
+static volatile uint32_t max_backlog_us = COALESCE_BACKLOG_US;
+
+static uint32_t frames_in = 0;
+static uint32_t frames_replaced = 0;
+static uint32_t frames_out = 0;
+static int count_high_water = 0;
+
+
+bool coalesce_active(void)
+{
+    return enabled || count > 0;
+}
+
+bool coalesce_pending(void)
+{
+    return count > 0;
+}
+
+static bool coalesce_has_key(size_t len, size_t offset, size_t klen)
+{
+    return len >= offset + klen;
+}
+
+bool coalesce_put(const uint8_t *frame, size_t len, uint32_t timestamp)
+{
+    assert(len <= COALESCE_MAX_FRAME_LEN);
+    uint32_t k = key;
+    size_t offset = k >> 16;
+    size_t klen = k & 0xFFFF;
+    bool keyed = enabled && coalesce_has_key(len, offset, klen);
+
+    coalesce_frame_t *slot = NULL;
+    if (keyed) {
+        for (int i = 0; i < count; i++) {
+            coalesce_frame_t *pending = &frames[(head + i) % COALESCE_MAX_FRAMES];
+            if (pending->keyed && coalesce_has_key(pending->len, offset, klen)
+                    && memcmp(pending->data + offset, frame + offset, klen) == 0) {
+                slot = pending;
+                frames_replaced++;
+                break;
+            }
+        }
+    }
+    if (slot == NULL) {
+        if (count == COALESCE_MAX_FRAMES) {
+            return false;
+        }
+        slot = &frames[(head + count) % COALESCE_MAX_FRAMES];
+        count++;
+        if (count > count_high_water) {
+            count_high_water = count;
+        }
+    }
+
+    memcpy(slot->data, frame, len);
+    slot->len = len;
+    slot->keyed = keyed;
+    slot->timestamp = timestamp;
+    frames_in++;
+    return true;
+}
+
+size_t coalesce_release(fanout_t *out)
+{
+    size_t written = 0;
+    while (count > 0) {
+        coalesce_frame_t *frame = &frames[head];
+        size_t queued = fanout_size(out) - fanout_free(out);
+        // once disabled, just get rid of what is left
+        if (enabled && uart_tx_backlog_us(queued + frame->len) > max_backlog_us) {
+            break;
+        }
+        if (fanout_free(out) < frame->len) {
+            break;
+        }
+        fanout_write(out, frame->data, frame->len, frame->timestamp, 0);
+        written += frame->len;
+        frames_out++;
+        head = (head + 1) % COALESCE_MAX_FRAMES;
+        count--;
+    }
+    return written;
+}
+
+static void coalesce_command(int fd, int argc, char **argv)
+{
+    if (argc >= 2 && strcmp(argv[1], "off") == 0) {
+        enabled = false;
+    } else if (argc >= 4 && strcmp(argv[1], "key") == 0) {
+        // a leading '-' wraps around in strtoul and fails the bound below
+        unsigned long offset = strtoul(argv[2], NULL, 0);
+        unsigned long len = strtoul(argv[3], NULL, 0);
+        if (len < 1 || len > COALESCE_MAX_KEY_LEN || offset > COALESCE_MAX_FRAME_LEN - len) {
+            control_printf(fd, "key must be 1-%d bytes within the first %d\n", COALESCE_MAX_KEY_LEN, COALESCE_MAX_FRAME_LEN);
+            return;
+        }
+        key = offset << 16 | len;
+        enabled = true;
+    } else if (argc >= 3 && strcmp(argv[1], "backlog") == 0) {
+        max_backlog_us = strtoul(argv[2], NULL, 0);
+    }
+
+    if (enabled) {
+        control_printf(fd, "key: offset=%lu length=%lu\n", (unsigned long)(key >> 16), (unsigned long)(key & 0xFFFF));
+    } else {
+        control_printf(fd, "key: off\n");
+    }
+    control_printf(fd, "backlog: %luus\n", (unsigned long)max_backlog_us);
+    control_printf(fd, "frames: in=%lu replaced=%lu out=%lu pending=%d high=%d\n",
+        (unsigned long)frames_in, (unsigned long)frames_replaced, (unsigned long)frames_out,
+        count, count_high_water);
+}
+
+void coalesce_init(void)
+{
+    control_register("coalesce", "[key <offset> <length>|backlog <us>|off] latest-value-wins host frames", coalesce_command);
+}
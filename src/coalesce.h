@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "fanout.h"
+
+// Latest-value-wins coalescing of host frames, between the mux and the stm32 tx buffer.
+//
+// When the host sends parameter updates faster than the stm32 link carries them, the
+// backlog grows and every later command waits behind it. With coalescing on, the mux
+// collects complete frames into a small table instead of the stm32 tx buffer, and only
+// releases them while the link has less than a configured backlog queued. A frame whose
+// key (bytes at a fixed offset in the frame) matches a pending one replaces it in place,
+// so the latest value goes out at the position of the oldest.
+//
+// Frames too short to have a key are queued unchanged. Frames longer than
+// COALESCE_MAX_FRAME_LEN are not held, they are forwarded directly.
+// Off by default, "coalesce key <offset> <length>" on the control port enables it.
+
+#define COALESCE_MAX_FRAMES     16
+#define COALESCE_MAX_FRAME_LEN  128
+#define COALESCE_MAX_KEY_LEN    8
+
+// registers the "coalesce" control command
+void coalesce_init(void);
+
+// The mux routes frames through the table while this is true.
+// Stays true after disabling until the table is empty.
+bool coalesce_active(void);
+
+// Add a complete frame. Returns false if the table is full.
+bool coalesce_put(const uint8_t *frame, size_t len, uint32_t timestamp);
+
+// Write pending frames to `out` while the stm32 link backlog stays below the limit.
+// Returns the number of bytes written.
+size_t coalesce_release(fanout_t *out);
+
+bool coalesce_pending(void);
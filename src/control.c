@@ -0,0 +1,164 @@
+#include "control.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+#include "esp_log.h"
+
+#include "port.h"
+#include "tasks.h"
+
+
+#define PORT                55534
+#define STACK_SIZE          (4096)
+#define MAX_COMMANDS        24
+#define MAX_ARGS            8
+#define LINE_LENGTH         128
+
+static const char *TAG = "control";
+
+typedef struct {
+    const char *name;
+    const char *help;
+    control_handler_t handler;
+} control_command_t;
+
+static control_command_t commands[MAX_COMMANDS];
+static int num_commands = 0;
+
+
+void control_register(const char *name, const char *help, control_handler_t handler)
+{
+    assert(num_commands < MAX_COMMANDS);
+    commands[num_commands++] = (control_command_t){
+        .name = name,
+        .help = help,
+        .handler = handler,
+    };
+}
+
+void control_printf(int fd, const char *fmt, ...)
+{
+    char buffer[256];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
+    if (len <= 0) {
+        return;
+    }
+    len = MIN(len, sizeof(buffer) - 1);
+
+    int to_write = len;
+    while (to_write > 0) {
+        int written = send(fd, buffer + (len - to_write), to_write, 0);
+        if (written < 0) {
+            break;
+        }
+        to_write -= written;
+    }
+}
+
+static void help_command(int fd, int argc, char **argv)
+{
+    for (int i = 0; i < num_commands; i++) {
+        control_printf(fd, "%s %s\n", commands[i].name, commands[i].help);
+    }
+}
+
+static void control_execute(int fd, char *line)
+{
+    char *argv[MAX_ARGS];
+    int argc = 0;
+    char *saveptr;
+    for (char *token = strtok_r(line, " \t\r", &saveptr);
+            token && argc < MAX_ARGS;
+            token = strtok_r(NULL, " \t\r", &saveptr)) {
+        argv[argc++] = token;
+    }
+    if (argc == 0) {
+        return;
+    }
+
+    for (int i = 0; i < num_commands; i++) {
+        if (strcmp(commands[i].name, argv[0]) == 0) {
+            commands[i].handler(fd, argc, argv);
+            control_printf(fd, "\n");
+            return;
+        }
+    }
+    control_printf(fd, "unknown command: %s\n\n", argv[0]);
+}
+
+static void control_session(int sock)
+{
+    char line[LINE_LENGTH];
+    size_t line_len = 0;
+
+    while (1) {
+        char rx_buffer[64];
+        port_wait_readable(sock, portMAX_DELAY);
+        int len = recv(sock, rx_buffer, sizeof(rx_buffer), 0);
+        if (len <= 0) {
+            return;
+        }
+        for (int i = 0; i < len; i++) {
+            if (rx_buffer[i] == '\n') {
+                line[line_len] = 0;
+                control_execute(sock, line);
+                line_len = 0;
+            } else if (line_len < sizeof(line) - 1) {
+                line[line_len++] = rx_buffer[i];
+            }
+        }
+    }
+}
+
+static void control_server_task(void *pvParameters)
+{
+    struct sockaddr_in dest_addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(PORT),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+
+    int listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    if (listen_sock < 0) {
+        ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
+        vTaskDelete(NULL);
+        return;
+    }
+    int opt = 1;
+    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    if (bind(listen_sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) != 0
+            || listen(listen_sock, 1) != 0) {
+        ESP_LOGE(TAG, "Unable to listen on port %d: errno %d", PORT, errno);
+        close(listen_sock);
+        vTaskDelete(NULL);
+        return;
+    }
+
+    while (1) {
+        port_wait_readable(listen_sock, portMAX_DELAY);
+        int sock = accept(listen_sock, NULL, NULL);
+        if (sock < 0) {
+            ESP_LOGE(TAG, "Unable to accept connection: errno %d", errno);
+            continue;
+        }
+        control_session(sock);
+        shutdown(sock, 0);
+        close(sock);
+    }
+}
+
+void create_control_server_task(void)
+{
+    control_register("help", "list commands", help_command);
+
+    task_create(control_server_task, "control", STACK_SIZE, NULL, 3);
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+// Control port: a line based text interface on its own TCP port, for querying
+// and tuning the bridge at runtime. Logging is disabled and the bridge ports carry
+// raw stm32 data, so this is the only way to look inside.
+//
+// Send "<command> [args]\n", the reply is zero or more lines followed by an empty line.
+// "help" lists the registered commands.
+
+typedef void (*control_handler_t)(int fd, int argc, char **argv);
+
+// Register a command. Only call before create_control_server_task().
+void control_register(const char *name, const char *help, control_handler_t handler);
+
+// write formatted text to the client, for use in command handlers.
+void control_printf(int fd, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// Requires the network stack to be initialized.
+void create_control_server_task(void);
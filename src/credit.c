@@ -0,0 +1,83 @@
+#include "credit.h"
+
+#include <string.h>
+
+
+static uint8_t credit_checksum(const credit_msg_t *msg)
+{
+    const uint8_t *bytes = (const uint8_t *)msg;
+    uint8_t sum = 0;
+    for (int i = 0; i < offsetof(credit_msg_t, checksum); i++) {
+        sum += bytes[i];
+    }
+    return sum;
+}
+
+void credit_msg_init(credit_msg_t *msg, uint8_t type, uint32_t value)
+{
+    *msg = (credit_msg_t){
+        .magic = {'F', 'O', 'C'},
+        .type = type,
+        .value = value,
+    };
+    msg->checksum = credit_checksum(msg);
+}
+
+size_t credit_msg_parse(const uint8_t *data, size_t len, uint8_t type, uint32_t *value)
+{
+    credit_msg_t msg;
+    if (len < sizeof(msg)) {
+        return 0;
+    }
+    memcpy(&msg, data, sizeof(msg));
+    if (memcmp(msg.magic, "FOC", 3) != 0 || msg.type != type
+            || msg.checksum != credit_checksum(&msg)) {
+        return 0;
+    }
+    if (value) {
+        *value = msg.value;
+    }
+    return sizeof(msg);
+}
+
+size_t credit_parse_request(credit_state_t *state, const uint8_t *data, size_t len)
+{
+    if (!credit_msg_parse(data, len, CREDIT_MSG_REQUEST, NULL)) {
+        return 0;
+    }
+
+    state->enabled = true;
+    state->received = 0;
+    state->granted = 0;
+    state->pending_len = 0;
+    return sizeof(credit_msg_t);
+}
+
+bool credit_due(const credit_state_t *state, size_t free_space, size_t size)
+{
+    if (!state->enabled) {
+        return false;
+    }
+    uint32_t limit = state->received + free_space;
+    if (state->granted == 0) {
+        return limit > 0;
+    }
+    // grant again once a quarter of the buffer opened up, not for every byte.
+    return (int32_t)(limit - state->granted) >= (int32_t)(size / 4);
+}
+
+bool credit_update(credit_state_t *state, size_t free_space, size_t size)
+{
+    if (state->pending_len > 0) {
+        return true;
+    }
+    if (!credit_due(state, free_space, size)) {
+        return false;
+    }
+
+    uint32_t limit = state->received + free_space;
+    credit_msg_init(&state->pending, CREDIT_MSG_GRANT, limit);
+    state->pending_len = sizeof(state->pending);
+    state->granted = limit;
+    return true;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Optional receive credits for host clients (TCP, USB serial).
+//
+// Backpressure towards the host is always there: TCP stops reading and the USB
+// endpoint NAKs once the client's rx buffer is full. Credits on top of that tell
+// the host how much it may send before it has to wait, so it can stream at full
+// rate without ever filling the transport buffers in between.
+//
+// A client opts in by sending a REQUEST as the first thing after connecting
+// (USB serial: at any point where nothing else is in flight). The ESP32 then sends
+// GRANTs between stm32 frames: the total number of bytes the client may have sent
+// since it opted in. Grants are absolute, a lost one is made up by the next.
+//
+// "FOC" <type> <value, uint32 little endian> <checksum: byte sum of the preceding bytes>,
+// the same layout as the stm32 link handshake.
+typedef struct __attribute__((packed)) {
+    char magic[3];
+    uint8_t type;
+    uint32_t value;
+    uint8_t checksum;
+} credit_msg_t;
+
+#define CREDIT_MSG_REQUEST  'R'
+#define CREDIT_MSG_GRANT    'C'
+
+// The same message layout carries other in-band messages, see timesync.h.
+void credit_msg_init(credit_msg_t *msg, uint8_t type, uint32_t value);
+// Returns the message length if `data` starts with a valid message of `type`, otherwise 0.
+size_t credit_msg_parse(const uint8_t *data, size_t len, uint8_t type, uint32_t *value);
+
+typedef struct {
+    bool enabled;
+    uint32_t received;      // bytes received since the client opted in
+    uint32_t granted;       // last limit sent
+    credit_msg_t pending;   // grant being sent
+    size_t pending_len;     // bytes of `pending` still to send
+} credit_state_t;
+
+// If `data` starts with a credit request, enable credits and return its length (to be
+// skipped), otherwise 0.
+size_t credit_parse_request(credit_state_t *state, const uint8_t *data, size_t len);
+
+// Account bytes received from the client.
+static inline void credit_received(credit_state_t *state, size_t len)
+{
+    state->received += len;
+}
+
+// true if enough buffer space was freed since the last grant to send a new one.
+bool credit_due(const credit_state_t *state, size_t free_space, size_t size);
+
+// Prepare a grant in state->pending if enough buffer space was freed since the last one.
+// `free_space` is the space left in the client's rx buffer of `size` bytes.
+// Returns true if there is something to send.
+bool credit_update(credit_state_t *state, size_t free_space, size_t size);
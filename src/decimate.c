@@ -0,0 +1,106 @@
+#include "decimate.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "control.h"
+#include "latency.h"
+
+// default age above which telemetry is thinned out, "decimate age <ms>" changes it.
+#define DECIMATE_TARGET_AGE_MS  100
+#define DECIMATE_WINDOW_US      250000
+
+// -1 while off
+static volatile int type_offset = -1;
+static uint8_t types[DECIMATE_MAX_TYPES];
+static volatile int num_types = 0;
+static volatile uint32_t target_age_us = DECIMATE_TARGET_AGE_MS * 1000;
+
+
+void decimate_reset(decimate_state_t *state)
+{
+    *state = (decimate_state_t){
+        .factor = 1,
+        .window_start = latency_now(),
+    };
+}
+
+// close the window if it is over and adapt the factor
+static void decimate_update(decimate_state_t *state)
+{
+    uint32_t now = latency_now();
+    uint32_t elapsed = now - state->window_start;
+    if (elapsed < DECIMATE_WINDOW_US) {
+        return;
+    }
+    state->drain_rate = (uint64_t)state->window_bytes * 1000000 / elapsed;
+    if (state->window_age_max > target_age_us) {
+        // falling behind, back off fast
+        state->factor = state->factor * 2 > DECIMATE_MAX_FACTOR ? DECIMATE_MAX_FACTOR : state->factor * 2;
+    } else if (state->factor > 1) {
+        state->factor--;
+    }
+    state->window_start = now;
+    state->window_bytes = 0;
+    state->window_age_max = 0;
+}
+
+bool decimate_skip(decimate_state_t *state, const uint8_t *frame, size_t len, uint32_t age_us)
+{
+    if (age_us > state->window_age_max) {
+        state->window_age_max = age_us;
+    }
+    decimate_update(state);
+
+    int offset = type_offset;
+    if (offset < 0 || offset >= len || state->factor <= 1) {
+        return false;
+    }
+    for (int i = 0; i < num_types; i++) {
+        if (frame[offset] == types[i]) {
+            if (state->counts[i]++ % state->factor == 0) {
+                return false;
+            }
+            state->dropped++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void decimate_sent(decimate_state_t *state, size_t len)
+{
+    state->window_bytes += len;
+}
+
+static void decimate_command(int fd, int argc, char **argv)
+{
+    if (argc >= 2 && strcmp(argv[1], "off") == 0) {
+        type_offset = -1;
+    } else if (argc >= 3 && strcmp(argv[1], "age") == 0) {
+        target_age_us = strtoul(argv[2], NULL, 10) * 1000;
+    } else if (argc >= 3) {
+        // decimate <offset> <type> [<type>...]
+        num_types = 0;
+        for (int i = 2; i < argc && num_types < DECIMATE_MAX_TYPES; i++) {
+            types[num_types++] = strtoul(argv[i], NULL, 0) & 0xFF;
+        }
+        type_offset = strtoul(argv[1], NULL, 0);
+    }
+
+    if (type_offset < 0) {
+        control_printf(fd, "telemetry types: none\n");
+    } else {
+        control_printf(fd, "telemetry types at offset %d:", type_offset);
+        for (int i = 0; i < num_types; i++) {
+            control_printf(fd, " 0x%02x", types[i]);
+        }
+        control_printf(fd, "\n");
+    }
+    control_printf(fd, "target age: %lums\n", (unsigned long)(target_age_us / 1000));
+}
+
+void decimate_init(void)
+{
+    control_register("decimate", "[<offset> <type>...|age <ms>|off] thin telemetry to slow tcp clients", decimate_command);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Adaptive thinning of stm32 telemetry towards a network client that can't keep up.
+//
+// The tcp_tx buffers are fed at uart speed. When WiFi throughput drops a client falls
+// behind and, without this, gets seconds-old data until its buffer overflows. Instead the
+// age of the data about to be sent is watched per client. Whenever it exceeds the target
+// within a window, only every Nth telemetry frame is sent and N doubles, while the client
+// keeps up N steps back down by one per window. Telemetry frames are the ones with one
+// of the configured type bytes at a fixed offset, all other frames (command responses)
+// are always sent. Each telemetry type keeps its own count, so every type still updates.
+//
+// Off until "decimate <offset> <type>..." on the control port names the telemetry types.
+
+#define DECIMATE_MAX_TYPES      8
+#define DECIMATE_MAX_FACTOR     64
+
+typedef struct {
+    uint32_t factor;                        // send every factor-th telemetry frame
+    uint32_t counts[DECIMATE_MAX_TYPES];
+    uint32_t window_start;                  // latency_now()
+    uint32_t window_bytes;                  // sent in the current window
+    uint32_t window_age_max;
+    uint32_t drain_rate;                    // bytes/s sent in the last window
+    uint32_t dropped;                       // frames left out
+} decimate_state_t;
+
+// registers the "decimate" control command
+void decimate_init(void);
+
+void decimate_reset(decimate_state_t *state);
+
+// For a complete frame at the read position of a client, received from the stm32
+// `age_us` ago: true if it should be left out.
+bool decimate_skip(decimate_state_t *state, const uint8_t *frame, size_t len, uint32_t age_us);
+
+// Account bytes sent to the client.
+void decimate_sent(decimate_state_t *state, size_t len);
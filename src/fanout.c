@@ -0,0 +1,477 @@
+#include "fanout.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+
+#include "control.h"
+
+// one event bit per reader for "data available", one for "space available"
+#define FANOUT_SPACE_BIT    (1 << FANOUT_MAX_READERS)
+// a reader that must give way loses this fraction of the buffer at once
+#define FANOUT_DROP_DIVIDER 8
+
+static const char *TAG = "fanout";
+
+typedef struct {
+    uint32_t end;           // head counter after the chunk was committed
+    uint32_t timestamp;
+} fanout_mark_t;
+
+struct fanout_reader_t {
+    fanout_t *fanout;
+    const char *name;
+    uint32_t tail;
+    uint32_t mark;          // first mark that may still cover unread data
+    bool attached;
+    bool reading;           // between read_begin and read_end, the region must not be dropped
+    EventBits_t bit;
+    fanout_notify_t notify;
+    void *notify_arg;
+    fanout_policy_t policy;
+    TickType_t block_time;
+    bool skipping;          // FANOUT_DROP_NEWEST: data from skip_at on is dropped once the tail gets there
+    uint32_t skip_at;
+    uint32_t dropped;       // bytes
+    uint32_t drops;         // times
+    uint32_t bytes;         // consumed
+    uint32_t chunks;
+};
+
+struct fanout_t {
+    const char *name;
+    uint8_t *storage;
+    uint32_t size;
+    // head and tails are free-running counters, the storage index is (counter & (size - 1))
+    uint32_t head;
+    portMUX_TYPE lock;
+    SemaphoreHandle_t write_lock;
+    EventGroupHandle_t events;
+    EventBits_t reader_bits;
+    int num_readers;
+    fanout_reader_t readers[FANOUT_MAX_READERS];
+    uint32_t mark_head;
+    fanout_mark_t marks[FANOUT_MAX_MARKS];
+    uint32_t chunks;        // write_end calls, the byte count is `head`
+    uint32_t high_water;    // most bytes ever unread by the slowest reader
+};
+
+static fanout_t *buffers[FANOUT_MAX_BUFFERS];
+static int num_buffers = 0;
+
+static const char *policy_names[] = {
+    [FANOUT_BLOCK] = "block",
+    [FANOUT_DROP_OLDEST] = "drop-oldest",
+    [FANOUT_DROP_NEWEST] = "drop-newest",
+};
+
+
+fanout_t *fanout_create(const char *name, size_t size)
+{
+    if (size == 0 || (size & (size - 1)) != 0) {
+        ESP_LOGE(TAG, "size must be a power of two");
+        return NULL;
+    }
+
+    fanout_t *fanout = calloc(1, sizeof(fanout_t));
+    if (fanout == NULL) {
+        return NULL;
+    }
+    fanout->storage = malloc(size);
+    fanout->events = xEventGroupCreate();
+    fanout->write_lock = xSemaphoreCreateMutex();
+    if (fanout->storage == NULL || fanout->events == NULL || fanout->write_lock == NULL) {
+        free(fanout->storage);
+        free(fanout);
+        return NULL;
+    }
+    fanout->name = name;
+    fanout->size = size;
+    fanout->lock = (portMUX_TYPE)portMUX_INITIALIZER_UNLOCKED;
+    if (num_buffers < FANOUT_MAX_BUFFERS) {
+        buffers[num_buffers++] = fanout;
+    }
+    return fanout;
+}
+
+fanout_reader_t *fanout_add_reader(fanout_t *fanout, const char *name)
+{
+    if (fanout->num_readers >= FANOUT_MAX_READERS) {
+        ESP_LOGE(TAG, "too many readers");
+        return NULL;
+    }
+
+    fanout_reader_t *reader = &fanout->readers[fanout->num_readers];
+    reader->fanout = fanout;
+    reader->name = name;
+    reader->bit = 1 << fanout->num_readers;
+    reader->policy = FANOUT_BLOCK;
+    reader->block_time = portMAX_DELAY;
+
+    taskENTER_CRITICAL(&fanout->lock);
+    reader->tail = fanout->head;
+    reader->mark = fanout->mark_head;
+    reader->attached = true;
+    fanout->reader_bits |= reader->bit;
+    fanout->num_readers++;
+    taskEXIT_CRITICAL(&fanout->lock);
+
+    return reader;
+}
+
+void fanout_reader_attach(fanout_reader_t *reader)
+{
+    fanout_t *fanout = reader->fanout;
+    taskENTER_CRITICAL(&fanout->lock);
+    reader->tail = fanout->head;
+    reader->mark = fanout->mark_head;
+    reader->attached = true;
+    reader->skipping = false;
+    taskEXIT_CRITICAL(&fanout->lock);
+}
+
+void fanout_reader_detach(fanout_reader_t *reader)
+{
+    fanout_t *fanout = reader->fanout;
+    taskENTER_CRITICAL(&fanout->lock);
+    reader->attached = false;
+    reader->reading = false;
+    taskEXIT_CRITICAL(&fanout->lock);
+
+    // the producer may be waiting on this reader
+    xEventGroupSetBits(fanout->events, FANOUT_SPACE_BIT);
+}
+
+void fanout_reader_set_policy(fanout_reader_t *reader, fanout_policy_t policy, TickType_t block_time)
+{
+    fanout_t *fanout = reader->fanout;
+    taskENTER_CRITICAL(&fanout->lock);
+    reader->policy = policy;
+    reader->block_time = block_time;
+    if (policy != FANOUT_DROP_NEWEST) {
+        reader->skipping = false;
+    }
+    taskEXIT_CRITICAL(&fanout->lock);
+
+    // the producer may be waiting for this reader
+    xEventGroupSetBits(fanout->events, FANOUT_SPACE_BIT);
+}
+
+// Make room by dropping the oldest data of full readers that may not hold up the producer
+// (any longer). Returns how long until the next blocking reader may be dropped.
+// Call with lock held.
+static TickType_t fanout_reclaim(fanout_t *fanout, TickType_t waited)
+{
+    TickType_t next = portMAX_DELAY;
+    for (int i = 0; i < fanout->num_readers; i++) {
+        fanout_reader_t *reader = &fanout->readers[i];
+        if (!reader->attached || reader->reading || fanout->head - reader->tail < fanout->size) {
+            continue;
+        }
+        if (reader->policy == FANOUT_BLOCK && waited < reader->block_time) {
+            next = MIN(next, reader->block_time - waited);
+            continue;
+        }
+        uint32_t drop = fanout->size / FANOUT_DROP_DIVIDER;
+        reader->tail += drop;
+        reader->dropped += drop;
+        reader->drops++;
+        if (reader->skipping && (int32_t)(reader->tail - reader->skip_at) >= 0) {
+            reader->skipping = false;
+        }
+    }
+    return next;
+}
+
+// bytes still unread by the slowest attached reader. Call with lock held.
+static uint32_t fanout_used(fanout_t *fanout)
+{
+    uint32_t used = 0;
+    for (int i = 0; i < fanout->num_readers; i++) {
+        fanout_reader_t *reader = &fanout->readers[i];
+        if (reader->attached) {
+            used = MAX(used, fanout->head - reader->tail);
+        }
+    }
+    return used;
+}
+
+size_t fanout_size(fanout_t *fanout)
+{
+    return fanout->size;
+}
+
+size_t fanout_free(fanout_t *fanout)
+{
+    taskENTER_CRITICAL(&fanout->lock);
+    uint32_t free_space = fanout->size - fanout_used(fanout);
+    taskEXIT_CRITICAL(&fanout->lock);
+    return free_space;
+}
+
+uint8_t *fanout_write_begin(fanout_t *fanout, size_t *len, TickType_t timeout)
+{
+    TimeOut_t time_out;
+    vTaskSetTimeOutState(&time_out);
+    TickType_t start = xTaskGetTickCount();
+
+    while (1) {
+        taskENTER_CRITICAL(&fanout->lock);
+        TickType_t next_drop = fanout_reclaim(fanout, xTaskGetTickCount() - start);
+        uint32_t free_space = fanout->size - fanout_used(fanout);
+        uint32_t offset = fanout->head & (fanout->size - 1);
+        taskEXIT_CRITICAL(&fanout->lock);
+
+        // never hand out a region that wraps around the end of the storage
+        uint32_t contiguous = MIN(free_space, fanout->size - offset);
+        if (contiguous > 0) {
+            *len = contiguous;
+            return fanout->storage + offset;
+        }
+
+        if (xTaskCheckForTimeOut(&time_out, &timeout) == pdTRUE) {
+            *len = 0;
+            return NULL;
+        }
+        xEventGroupWaitBits(fanout->events, FANOUT_SPACE_BIT, pdTRUE, pdFALSE, MIN(timeout, next_drop));
+    }
+}
+
+void fanout_write_end(fanout_t *fanout, size_t len, uint32_t timestamp)
+{
+    if (len == 0) {
+        return;
+    }
+
+    taskENTER_CRITICAL(&fanout->lock);
+    fanout_mark_t *last = &fanout->marks[(fanout->mark_head - 1) & (FANOUT_MAX_MARKS - 1)];
+    if (fanout->mark_head != 0 && last->end == fanout->head && last->timestamp == timestamp) {
+        // continuation of the previous chunk, e.g. a write split at the end of the storage
+        last->end += len;
+    } else {
+        fanout_mark_t *mark = &fanout->marks[fanout->mark_head & (FANOUT_MAX_MARKS - 1)];
+        mark->end = fanout->head + len;
+        mark->timestamp = timestamp;
+        fanout->mark_head++;
+    }
+    fanout->head += len;
+    fanout->chunks++;
+    fanout->high_water = MAX(fanout->high_water, fanout_used(fanout));
+
+    for (int i = 0; i < fanout->num_readers; i++) {
+        fanout_reader_t *reader = &fanout->readers[i];
+        if (reader->attached && reader->policy == FANOUT_DROP_NEWEST && !reader->skipping
+                && fanout->head - reader->tail > fanout->size / 2) {
+            // everything beyond half the buffer is lost for this reader, until it gets there.
+            reader->skipping = true;
+            reader->skip_at = reader->tail + fanout->size / 2;
+            reader->drops++;
+        }
+    }
+    taskEXIT_CRITICAL(&fanout->lock);
+
+    xEventGroupSetBits(fanout->events, fanout->reader_bits);
+    for (int i = 0; i < fanout->num_readers; i++) {
+        fanout_reader_t *reader = &fanout->readers[i];
+        if (reader->attached && reader->notify) {
+            reader->notify(reader->notify_arg);
+        }
+    }
+}
+
+size_t fanout_write(fanout_t *fanout, const void *data, size_t len, uint32_t timestamp, TickType_t timeout)
+{
+    TimeOut_t time_out;
+    vTaskSetTimeOutState(&time_out);
+
+    if (xSemaphoreTake(fanout->write_lock, timeout) != pdTRUE) {
+        return 0;
+    }
+
+    size_t written = 0;
+    while (written < len) {
+        xTaskCheckForTimeOut(&time_out, &timeout);
+        size_t free_len;
+        uint8_t *dst = fanout_write_begin(fanout, &free_len, timeout);
+        if (dst == NULL) {
+            break;
+        }
+        free_len = MIN(free_len, len - written);
+        memcpy(dst, (const uint8_t *)data + written, free_len);
+        fanout_write_end(fanout, free_len, timestamp);
+        written += free_len;
+    }
+
+    xSemaphoreGive(fanout->write_lock);
+    return written;
+}
+
+void fanout_reader_set_notify(fanout_reader_t *reader, fanout_notify_t notify, void *arg)
+{
+    fanout_t *fanout = reader->fanout;
+    taskENTER_CRITICAL(&fanout->lock);
+    reader->notify_arg = arg;
+    reader->notify = notify;
+    taskEXIT_CRITICAL(&fanout->lock);
+}
+
+const uint8_t *fanout_read_begin(fanout_reader_t *reader, size_t *len, size_t max_len, TickType_t timeout)
+{
+    fanout_t *fanout = reader->fanout;
+    TimeOut_t time_out;
+    vTaskSetTimeOutState(&time_out);
+
+    while (1) {
+        taskENTER_CRITICAL(&fanout->lock);
+        if (reader->skipping && reader->tail == reader->skip_at) {
+            // caught up, drop what arrived in the meantime and continue with the newest data.
+            reader->dropped += fanout->head - reader->skip_at;
+            reader->tail = fanout->head;
+            reader->skipping = false;
+        }
+        uint32_t end = reader->skipping ? reader->skip_at : fanout->head;
+        uint32_t available = reader->attached ? end - reader->tail : 0;
+        uint32_t offset = reader->tail & (fanout->size - 1);
+        reader->reading = available > 0;
+        taskEXIT_CRITICAL(&fanout->lock);
+
+        uint32_t contiguous = MIN(available, fanout->size - offset);
+        if (contiguous > 0) {
+            *len = MIN(contiguous, max_len);
+            return fanout->storage + offset;
+        }
+
+        if (xTaskCheckForTimeOut(&time_out, &timeout) == pdTRUE) {
+            *len = 0;
+            return NULL;
+        }
+        // the bit may be stale from data that was already consumed, in which case we just loop again
+        xEventGroupWaitBits(fanout->events, reader->bit, pdTRUE, pdFALSE, timeout);
+    }
+}
+
+bool fanout_read_timestamp(fanout_reader_t *reader, uint32_t *timestamp)
+{
+    fanout_t *fanout = reader->fanout;
+    bool found = false;
+
+    taskENTER_CRITICAL(&fanout->lock);
+    // the oldest remembered mark is only usable if the one before it still exists,
+    // otherwise we can't tell where its chunk starts.
+    uint32_t oldest_usable = fanout->mark_head > FANOUT_MAX_MARKS ? fanout->mark_head - FANOUT_MAX_MARKS + 1 : 0;
+    if ((int32_t)(reader->mark - oldest_usable) < 0) {
+        reader->mark = oldest_usable;
+        if ((int32_t)(fanout->marks[(reader->mark - 1) & (FANOUT_MAX_MARKS - 1)].end - reader->tail) > 0) {
+            // the chunk containing the tail has been forgotten
+            taskEXIT_CRITICAL(&fanout->lock);
+            return false;
+        }
+    }
+    // skip the chunks that were consumed completely
+    while (reader->mark != fanout->mark_head
+            && (int32_t)(fanout->marks[reader->mark & (FANOUT_MAX_MARKS - 1)].end - reader->tail) <= 0) {
+        reader->mark++;
+    }
+    if (reader->mark != fanout->mark_head) {
+        *timestamp = fanout->marks[reader->mark & (FANOUT_MAX_MARKS - 1)].timestamp;
+        found = true;
+    }
+    taskEXIT_CRITICAL(&fanout->lock);
+
+    return found;
+}
+
+void fanout_read_end(fanout_reader_t *reader, size_t len)
+{
+    fanout_t *fanout = reader->fanout;
+
+    taskENTER_CRITICAL(&fanout->lock);
+    reader->tail += len;
+    reader->reading = false;
+    if (len > 0) {
+        reader->bytes += len;
+        reader->chunks++;
+    }
+    taskEXIT_CRITICAL(&fanout->lock);
+
+    xEventGroupSetBits(fanout->events, FANOUT_SPACE_BIT);
+}
+
+int fanout_num_buffers(void)
+{
+    return num_buffers;
+}
+
+void fanout_get_stats(int index, fanout_stats_t *stats)
+{
+    fanout_t *fanout = buffers[index];
+    taskENTER_CRITICAL(&fanout->lock);
+    stats->name = fanout->name;
+    stats->size = fanout->size;
+    stats->used = fanout_used(fanout);
+    stats->high_water = fanout->high_water;
+    stats->bytes = fanout->head;
+    stats->chunks = fanout->chunks;
+    stats->dropped = 0;
+    for (int i = 0; i < fanout->num_readers; i++) {
+        stats->dropped += fanout->readers[i].dropped;
+    }
+    taskEXIT_CRITICAL(&fanout->lock);
+}
+
+static void buffers_command(int fd, int argc, char **argv)
+{
+    if (argc >= 3) {
+        for (int b = 0; b < num_buffers; b++) {
+            for (int i = 0; i < buffers[b]->num_readers; i++) {
+                fanout_reader_t *reader = &buffers[b]->readers[i];
+                if (strcmp(reader->name, argv[1]) != 0) {
+                    continue;
+                }
+                for (int p = 0; p < sizeof(policy_names) / sizeof(policy_names[0]); p++) {
+                    if (strcmp(argv[2], policy_names[p]) == 0) {
+                        TickType_t block_time = argc >= 4 ? pdMS_TO_TICKS(atoi(argv[3])) : portMAX_DELAY;
+                        fanout_reader_set_policy(reader, p, block_time);
+                    }
+                }
+            }
+        }
+    }
+
+    for (int b = 0; b < num_buffers; b++) {
+        fanout_t *fanout = buffers[b];
+        taskENTER_CRITICAL(&fanout->lock);
+        uint32_t used = fanout_used(fanout);
+        taskEXIT_CRITICAL(&fanout->lock);
+        control_printf(fd, "%s: size=%lu used=%lu high=%lu bytes=%lu chunks=%lu\n", fanout->name,
+            (unsigned long)fanout->size, (unsigned long)used, (unsigned long)fanout->high_water,
+            (unsigned long)fanout->head, (unsigned long)fanout->chunks);
+
+        for (int i = 0; i < fanout->num_readers; i++) {
+            fanout_reader_t reader;
+            taskENTER_CRITICAL(&fanout->lock);
+            reader = fanout->readers[i];
+            taskEXIT_CRITICAL(&fanout->lock);
+
+            control_printf(fd, "  %s: %s", reader.name, policy_names[reader.policy]);
+            if (reader.policy == FANOUT_BLOCK && reader.block_time != portMAX_DELAY) {
+                control_printf(fd, " %lums", (unsigned long)pdTICKS_TO_MS(reader.block_time));
+            }
+            control_printf(fd, " %s unread=%lu bytes=%lu chunks=%lu dropped=%lu drops=%lu\n",
+                reader.attached ? "attached" : "detached",
+                reader.attached ? (unsigned long)(fanout->head - reader.tail) : 0UL,
+                (unsigned long)reader.bytes, (unsigned long)reader.chunks,
+                (unsigned long)reader.dropped, (unsigned long)reader.drops);
+        }
+    }
+}
+
+void fanout_init(void)
+{
+    control_register("buffers", "[<reader> block [ms]|drop-oldest|drop-newest] buffer fill, per reader overflow policy and drops", buffers_command);
+}
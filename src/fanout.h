@@ -0,0 +1,104 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+
+#define FANOUT_MAX_READERS  8
+// number of chunk timestamps remembered, must be a power of two.
+#define FANOUT_MAX_MARKS    128
+#define FANOUT_MAX_BUFFERS  16
+
+// Single-producer / multi-consumer byte buffer.
+//
+// The producer writes every byte exactly once into shared storage. Each reader
+// holds its own read cursor over that storage, so one incoming stream can feed
+// several sinks without copying it per sink. Space is reclaimed once all
+// attached readers have consumed it.
+//
+// Data is accessed in place: the producer asks for a contiguous free region,
+// fills it and commits, readers get a pointer to a contiguous readable region
+// and return it when done.
+//
+// Every committed chunk carries a timestamp (see latency.h), readers can look up
+// the timestamp of the chunk they are about to consume.
+//
+// Each reader has an overflow policy for when it falls a whole buffer behind,
+// so one slow sink doesn't have to hold up the others. "buffers" on the control
+// port shows the drop counters and changes policies at runtime.
+typedef struct fanout_t fanout_t;
+typedef struct fanout_reader_t fanout_reader_t;
+
+typedef enum {
+    FANOUT_BLOCK,           // the producer waits up to block_time, then drops the reader's oldest data
+    FANOUT_DROP_OLDEST,     // the producer never waits, the reader loses its oldest unread data
+    FANOUT_DROP_NEWEST,     // the producer never waits, the reader keeps up to half the buffer
+                            // unread and loses what arrives beyond that until it caught up
+} fanout_policy_t;
+
+// registers the "buffers" control command
+void fanout_init(void);
+
+typedef struct {
+    const char *name;
+    uint32_t size;
+    uint32_t used;          // unread by the slowest attached reader
+    uint32_t high_water;    // highest `used` so far
+    uint32_t bytes;         // total written, wraps
+    uint32_t chunks;
+    uint32_t dropped;       // bytes dropped, summed over all readers
+} fanout_stats_t;
+
+// every buffer created so far, in creation order
+int fanout_num_buffers(void);
+void fanout_get_stats(int index, fanout_stats_t *stats);
+
+// size must be a power of two.
+fanout_t *fanout_create(const char *name, size_t size);
+
+// Register a reader. All readers must be added before the producer starts.
+// Readers start attached, with FANOUT_BLOCK and no time limit.
+fanout_reader_t *fanout_add_reader(fanout_t *fanout, const char *name);
+
+// Data held by a reader between fanout_read_begin() and fanout_read_end() is never dropped.
+void fanout_reader_set_policy(fanout_reader_t *reader, fanout_policy_t policy, TickType_t block_time);
+
+// A detached reader does not hold back the producer and receives nothing.
+// Attaching skips everything written while the reader was detached.
+// Only call these from the task that reads from the reader.
+void fanout_reader_attach(fanout_reader_t *reader);
+void fanout_reader_detach(fanout_reader_t *reader);
+
+// Producer: get a contiguous writable region of at least 1 byte, waiting up to
+// `timeout` for the slowest blocking reader to free space. Returns NULL on timeout.
+uint8_t *fanout_write_begin(fanout_t *fanout, size_t *len, TickType_t timeout);
+// Producer: publish the first `len` bytes of the region from fanout_write_begin(),
+// tagged with the time they entered the bridge.
+void fanout_write_end(fanout_t *fanout, size_t len, uint32_t timestamp);
+
+size_t fanout_size(fanout_t *fanout);
+
+// Free space for the producer, i.e. what the slowest attached reader has consumed.
+// Only a lower bound when read concurrently with the readers.
+size_t fanout_free(fanout_t *fanout);
+
+// Copy `len` bytes into the buffer, waiting up to `timeout` for space.
+// Unlike fanout_write_begin/end this may be used by several producers at once,
+// each call is written contiguously. Returns the number of bytes written.
+size_t fanout_write(fanout_t *fanout, const void *data, size_t len, uint32_t timestamp, TickType_t timeout);
+
+// Called by the producer after committing data for an attached reader, so a task can
+// wait on several buffers (or sockets) at once. Must not block.
+typedef void (*fanout_notify_t)(void *arg);
+void fanout_reader_set_notify(fanout_reader_t *reader, fanout_notify_t notify, void *arg);
+
+// Reader: get a contiguous readable region of at most `max_len` bytes.
+// Returns NULL if nothing arrived within `timeout`.
+const uint8_t *fanout_read_begin(fanout_reader_t *reader, size_t *len, size_t max_len, TickType_t timeout);
+// Reader: timestamp of the chunk containing the first byte of the current region.
+// Returns false if it is not known anymore, because the reader lagged too many chunks behind.
+bool fanout_read_timestamp(fanout_reader_t *reader, uint32_t *timestamp);
+// Reader: mark the first `len` bytes of the region from fanout_read_begin() as consumed.
+// Call it even if nothing was consumed (len 0), to release the region.
+void fanout_read_end(fanout_reader_t *reader, size_t len);
@@ -2,11 +2,17 @@
 
 #include "freertos/FreeRTOS.h"
 #include <string.h>
+#include <sys/param.h>
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_app_desc.h"
 
 #include "board_config.h"
 #include "i2c_slave_driver.h"
 #include "wifi.h"
+#include "stats.h"
+#include "tcp_server.h"
+#include "tasks.h"
 
 
 static const char *TAG = "i2c_slave";
@@ -14,18 +20,12 @@ static const char *TAG = "i2c_slave";
 #define STACK_SIZE (4096)
 
 #define I2C_SLAVE_NUM    0
-#define DATA_LENGTH      100
 
+// the driver takes at most 255 bytes per read, including the CRC
+#define REGISTER_SIZE    255
 
-i2c_slave_device_t *slave_handle = NULL;
-
-QueueHandle_t wifi_update_params_queue;
 
-uint8_t txbuffer[256];
-uint8_t txbuffer_len;
-
-uint8_t ssid[32];
-uint8_t password[64];
+i2c_slave_device_t *slave_handle = NULL;
 
 #define ESP32_I2C_ADDRESS   0x72
 
@@ -34,7 +34,60 @@ uint8_t password[64];
 #define ESP32_COMMAND_WIFI_SSID         0x03    // write
 #define ESP32_COMMAND_WIFI_PASSWORD     0x04    // write
 #define ESP32_COMMAND_WIFI_RECONNECT    0x05    // write
+#define ESP32_COMMAND_STATS             0x06    // write page number (optional, default 0), read page, see stats.h
+#define ESP32_COMMAND_STATUS            0x07    // read
+
+typedef struct {
+    uint8_t len;                    // including the CRC
+    uint8_t data[REGISTER_SIZE];
+} i2c_register_t;
+
+typedef struct {
+    i2c_register_t fwversion;
+    i2c_register_t ip;
+    i2c_register_t status;
+    i2c_register_t stats[STATS_NUM_PAGES];
+} i2c_snapshot_t;
+
+// the task fills one while the callback reads the other
+static i2c_snapshot_t snapshots[2];
+static volatile int published = 0;
+// register selected by the last write, sent on the following read. Kept as a command and
+// page and looked up at read time, the read may come any time later.
+static int selected = -1;
+static uint8_t selected_page;
+
+// a write, decoded by the task
+typedef struct {
+    uint8_t cmd;
+    uint8_t len;
+    uint8_t data[64];
+} i2c_write_t;
 
+static QueueHandle_t write_queue;
+
+
+static const i2c_register_t *i2c_register(const i2c_snapshot_t *snapshot, int cmd, uint8_t page)
+{
+    switch (cmd) {
+        case ESP32_COMMAND_FWVERSION:   return &snapshot->fwversion;
+        case ESP32_COMMAND_IP:          return &snapshot->ip;
+        case ESP32_COMMAND_STATUS:      return &snapshot->status;
+        case ESP32_COMMAND_STATS:       return page < STATS_NUM_PAGES ? &snapshot->stats[page] : NULL;
+        default:                        return NULL;
+    }
+}
+
+// longer writes are dropped
+static size_t i2c_write_max_len(uint8_t cmd)
+{
+    switch (cmd) {
+        case ESP32_COMMAND_WIFI_SSID:       return 32;
+        case ESP32_COMMAND_WIFI_PASSWORD:   return 64;
+        // payload ignored
+        default:                            return sizeof(((i2c_write_t *)0)->data);
+    }
+}
 
 
 static bool slave_callback(struct i2c_slave_device_t *dev, I2CSlaveCallbackReason reason)
@@ -43,81 +96,151 @@ static bool slave_callback(struct i2c_slave_device_t *dev, I2CSlaveCallbackReaso
         // ignore
     }
     if (reason == I2C_CALLBACK_DONE) {
-        txbuffer_len = 0;
-        uint8_t len;
+        selected = -1;
 
         if (dev->bufend >= 1) {
             uint8_t cmd = dev->buffer[0];
+            uint8_t len = dev->bufend - 1;
             switch (cmd) {
                 case ESP32_COMMAND_FWVERSION:
-                    // TODO
-                    break;
-
                 case ESP32_COMMAND_IP:
-                    uint32_t ip = wifi_get_ip();
-                    txbuffer[3] = (ip >> 24) & 0xff;
-                    txbuffer[2] = (ip >> 16) & 0xff;
-                    txbuffer[1] = (ip >> 8) & 0xff;
-                    txbuffer[0] = (ip >> 0) & 0xff;
-                    txbuffer_len = 4;
+                case ESP32_COMMAND_STATUS:
+                    selected = cmd;
                     break;
-
-                case ESP32_COMMAND_WIFI_SSID:
-                    memset(ssid, 0, 32);
-                    len = dev->bufend - 1;
-                    if (len <= 32) {
-                        memcpy(ssid, dev->buffer + 1, len);
-                        xQueueSendFromISR(wifi_update_params_queue, &cmd, NULL);
-                    }
+                case ESP32_COMMAND_STATS:
+                    selected = cmd;
+                    selected_page = len >= 1 ? dev->buffer[1] : 0;
                     break;
 
+                case ESP32_COMMAND_WIFI_SSID:
                 case ESP32_COMMAND_WIFI_PASSWORD:
-                    memset(password, 0, 64);
-                    len = dev->bufend - 1;
-                    if (len <= 64) {
-                        memcpy(password, dev->buffer + 1, len);
-                        xQueueSendFromISR(wifi_update_params_queue, &cmd, NULL);
-                    }
-                    break;
                 case ESP32_COMMAND_WIFI_RECONNECT:
-                    xQueueSendFromISR(wifi_update_params_queue, &cmd, NULL);
+                    if (len <= i2c_write_max_len(cmd)) {
+                        i2c_write_t msg = {.cmd = cmd, .len = len};
+                        memcpy(msg.data, dev->buffer + 1, len);
+                        xQueueSendFromISR(write_queue, &msg, NULL);
+                    }
                     break;
                 default:
             }
         }
     }
     if (reason == I2C_CALLBACK_SEND_DATA) {
-        uint8_t len = txbuffer_len;
-        i2c_slave_send_data(dev, txbuffer, &len);
+        static uint8_t empty[1];
+        // the snapshot published now, not the one at selection
+        const i2c_register_t *reg = i2c_register(&snapshots[published], selected, selected_page);
+        uint8_t len = reg ? reg->len : 0;
+        i2c_slave_send_data(dev, reg ? (uint8_t *)reg->data : empty, &len);
     }
 
     return true;
 }
 
-static void wifi_update_task(void *pvParameters) {
+// CRC-16/CCITT-FALSE
+static uint16_t crc16(const uint8_t *data, size_t len)
+{
+    uint16_t crc = 0xffff;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= data[i] << 8;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+static void put_u32(uint8_t *dst, uint32_t value)
+{
+    for (int i = 0; i < 4; i++) {
+        dst[i] = (value >> (8 * i)) & 0xff;
+    }
+}
+
+static void register_set(i2c_register_t *reg, const uint8_t *data, size_t len)
+{
+    len = MIN(len, REGISTER_SIZE - 2);
+    memcpy(reg->data, data, len);
+    uint16_t crc = crc16(data, len);
+    reg->data[len] = crc >> 8;
+    reg->data[len + 1] = crc & 0xff;
+    reg->len = len + 2;
+}
+
+static void build_snapshot(i2c_snapshot_t *snapshot)
+{
+    uint8_t buf[REGISTER_SIZE];
+
+    memset(buf, 0, 32);
+    strncpy((char *)buf, esp_app_get_description()->version, 32);
+    register_set(&snapshot->fwversion, buf, 32);
+
+    wifi_status_t wifi;
+    wifi_get_status(&wifi);
+    put_u32(buf, wifi.ip);
+    register_set(&snapshot->ip, buf, 4);
+
+    buf[0] = (wifi.ip != 0) | (wifi.associated << 1);
+    buf[1] = wifi.rssi;
+    buf[2] = wifi.channel;
+    buf[3] = tcp_server_num_clients();
+    put_u32(buf + 4, esp_timer_get_time() / 1000);
+    put_u32(buf + 8, wifi.disconnects);
+    put_u32(buf + 12, wifi.connect_time_ms);
+    register_set(&snapshot->status, buf, 16);
+
+    for (int page = 0; page < STATS_NUM_PAGES; page++) {
+        size_t len = stats_read_page(page, buf, REGISTER_SIZE - 2);
+        register_set(&snapshot->stats[page], buf, len);
+    }
+}
+
+static void handle_write(const i2c_write_t *msg)
+{
+    switch (msg->cmd) {
+        case ESP32_COMMAND_WIFI_SSID:
+            uint8_t ssid[32] = {0};
+            memcpy(ssid, msg->data, MIN(msg->len, sizeof(ssid)));
+            wifi_set_ssid(ssid);
+            break;
+        case ESP32_COMMAND_WIFI_PASSWORD:
+            uint8_t password[64] = {0};
+            memcpy(password, msg->data, MIN(msg->len, sizeof(password)));
+            wifi_set_password(password);
+            break;
+        case ESP32_COMMAND_WIFI_RECONNECT:
+            wifi_reconnect();
+            break;
+    }
+}
+
+// rebuilds the snapshot and carries out writes
+static void i2c_slave_task(void *pvParameters) {
+    TickType_t last_build = xTaskGetTickCount() - pdMS_TO_TICKS(I2C_SNAPSHOT_INTERVAL_MS);
     while (1) {
-        uint8_t cmd = 0;
-        if (xQueueReceive(wifi_update_params_queue, &cmd, portMAX_DELAY) == pdTRUE) {
-            // ESP_LOGW(TAG, "receive cmd: %i", cmd);
-            switch (cmd) {
-                case ESP32_COMMAND_WIFI_SSID:
-                    wifi_set_ssid(ssid);
-                    break;
-                case ESP32_COMMAND_WIFI_PASSWORD:
-                    wifi_set_password(password);
-                    break;
-                case ESP32_COMMAND_WIFI_RECONNECT:
-                    wifi_reconnect();
-                    break;
-            }
-        } else {
-            ESP_LOGW(TAG, "Failed to receive item");
+        TickType_t elapsed = xTaskGetTickCount() - last_build;
+        TickType_t interval = pdMS_TO_TICKS(I2C_SNAPSHOT_INTERVAL_MS);
+        i2c_write_t msg;
+        if (xQueueReceive(write_queue, &msg, elapsed < interval ? interval - elapsed : 0) == pdTRUE) {
+            // ESP_LOGW(TAG, "receive cmd: %i", msg.cmd);
+            handle_write(&msg);
+        }
+        if (xTaskGetTickCount() - last_build >= interval) {
+            // reads look up the published snapshot when they start and take well under
+            // a millisecond, the spare one is only written an interval later
+            int next = !published;
+            build_snapshot(&snapshots[next]);
+            published = next;
+            last_build = xTaskGetTickCount();
         }
     }
 }
 
 void init_i2c_slave()
 {
+    // something valid to read before the task runs
+    build_snapshot(&snapshots[published]);
+    write_queue = xQueueCreate(4, sizeof(i2c_write_t));
+
     i2c_slave_config_t slave_config = {
         .callback = slave_callback,
         .address = ESP32_I2C_ADDRESS,
@@ -127,7 +250,7 @@ void init_i2c_slave()
     };
 
     ESP_ERROR_CHECK(i2c_slave_new(&slave_config, &slave_handle));
+    ESP_LOGI(TAG, "slave at address 0x%02x", ESP32_I2C_ADDRESS);
 
-    wifi_update_params_queue = xQueueCreate(10, 1);
-    xTaskCreate(wifi_update_task, "I2C slave", STACK_SIZE, (void*)NULL, 10, NULL);
-}
\ No newline at end of file
+    task_create(i2c_slave_task, "I2C slave", STACK_SIZE, (void*)NULL, 10);
+}
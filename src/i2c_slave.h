@@ -2,6 +2,26 @@
 
 #include <stdint.h>
 
-void init_i2c_slave();
+// I2C slave towards the stm32, a register map.
+//
+// The stm32 writes a register number, optionally followed by data, and reads the register
+// back. Readable registers come from a snapshot that a background task rebuilds every
+// I2C_SNAPSHOT_INTERVAL_MS into the spare one of two buffers, so the I2C callback only picks
+// a pointer and never waits. Every read returns the register contents followed by their
+// CRC-16/CCITT-FALSE (poly 0x1021, init 0xffff, big endian), a master that reads fewer bytes
+// just doesn't see it. Written data is queued to the same task.
+//
+// Registers, all values little endian:
+//   0x01 FWVERSION (r)      char version[32], esp_app_get_description(), zero padded
+//   0x02 IP (r)             u32 ip, 0 without an address
+//   0x03 WIFI_SSID (w)      up to 32 bytes
+//   0x04 WIFI_PASSWORD (w)  up to 64 bytes
+//   0x05 WIFI_RECONNECT (w)
+//   0x06 STATS (w/r)        write the page number (default 0), read the page, see stats.h
+//   0x07 STATUS (r)         u8 flags (bit 0: has ip, bit 1: associated), i8 rssi, u8 channel,
+//                           u8 tcp clients, u32 uptime_ms, u32 wifi disconnects,
+//                           u32 duration of the last wifi connect in ms
+
+#define I2C_SNAPSHOT_INTERVAL_MS    100
 
-// void i2c_slave_set_fwversion(void);
+void init_i2c_slave();
@@ -0,0 +1,175 @@
+#include "latency.h"
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "control.h"
+#include "tasks.h"
+
+#define JITTER_STACK_SIZE   (2048)
+
+// bucket 0 counts 0us, bucket n counts [2^(n-1), 2^n) us, the last bucket everything above.
+#define LATENCY_BUCKETS     24
+
+typedef struct {
+    uint32_t count;
+    uint64_t sum_us;
+    uint32_t max_us;
+    uint32_t buckets[LATENCY_BUCKETS];
+} latency_histogram_t;
+
+static const char *hop_names[LATENCY_NUM_HOPS] = {
+    [LATENCY_USB_RX_QUEUE] = "usb rx queue",
+    [LATENCY_TCP_RX_QUEUE] = "tcp rx queue",
+    [LATENCY_UDP_RX_QUEUE] = "udp rx queue",
+    [LATENCY_MUX] = "mux",
+    [LATENCY_STM_TX] = "host -> stm32",
+    [LATENCY_USB_TX] = "stm32 -> usb",
+    [LATENCY_TCP_TX] = "stm32 -> tcp",
+    [LATENCY_UDP_TX] = "stm32 -> udp",
+    [LATENCY_STM_TX_GAP] = "stm32 tx stall",
+    [LATENCY_STM_TX_JITTER] = "stm32 tx jitter",
+    [LATENCY_WAKEUP] = "bridge core wakeup",
+    [LATENCY_STM_TX_URGENT] = "host -> stm32 urgent",
+    [LATENCY_SCHEDULE] = "schedule release",
+    [LATENCY_SCHEDULE_QUEUE] = "schedule queue",
+};
+
+static latency_histogram_t histograms[LATENCY_NUM_HOPS];
+static uint32_t window_max_us[LATENCY_NUM_HOPS];
+static portMUX_TYPE histograms_lock = portMUX_INITIALIZER_UNLOCKED;
+
+volatile bool latency_jitter_enabled = false;
+static TaskHandle_t jitter_task_handle;
+
+
+void latency_record(latency_hop_t hop, uint32_t us)
+{
+    int bucket = us ? 32 - __builtin_clz(us) : 0;
+    if (bucket >= LATENCY_BUCKETS) {
+        bucket = LATENCY_BUCKETS - 1;
+    }
+
+    taskENTER_CRITICAL(&histograms_lock);
+    latency_histogram_t *h = &histograms[hop];
+    h->count++;
+    h->sum_us += us;
+    if (us > h->max_us) {
+        h->max_us = us;
+    }
+    h->buckets[bucket]++;
+    if (us > window_max_us[hop]) {
+        window_max_us[hop] = us;
+    }
+    taskEXIT_CRITICAL(&histograms_lock);
+}
+
+uint32_t latency_take_max(latency_hop_t hop)
+{
+    taskENTER_CRITICAL(&histograms_lock);
+    uint32_t us = window_max_us[hop];
+    window_max_us[hop] = 0;
+    taskEXIT_CRITICAL(&histograms_lock);
+    return us;
+}
+
+void latency_record_cadence(uint32_t arrived, uint32_t sent)
+{
+    static uint32_t last_arrived;
+    static uint32_t last_sent;
+    static bool valid = false;
+
+    // chunks that arrived 2ms apart should go out 2ms apart
+    if (valid) {
+        int32_t distortion = (int32_t)((sent - last_sent) - (arrived - last_arrived));
+        latency_record(LATENCY_STM_TX_JITTER, distortion < 0 ? -distortion : distortion);
+    }
+    last_arrived = arrived;
+    last_sent = sent;
+    valid = true;
+}
+
+// wakes up every tick on the bridge core and records how late it got to run.
+// The due time runs on a fixed schedule from the first wakeup, so a steady delay shows up
+// instead of being taken as the new reference.
+static void jitter_task(void *pvParameters)
+{
+    const uint32_t period_us = portTICK_PERIOD_MS * 1000;
+    bool anchored = false;
+    TickType_t wake = 0;
+    uint32_t expected = 0;
+
+    while (1) {
+        if (!latency_jitter_enabled) {
+            anchored = false;
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+        if (!anchored) {
+            vTaskDelay(1);
+            wake = xTaskGetTickCount();
+            expected = latency_now();
+            anchored = true;
+        }
+        vTaskDelayUntil(&wake, 1);
+        expected += period_us;
+        uint32_t now = latency_now();
+        int32_t late = (int32_t)(now - expected);
+        if (late < 0) {
+            // earlier than ever before, the first wakeup was late itself: move the tick edge
+            expected = now;
+            late = 0;
+        }
+        latency_record(LATENCY_WAKEUP, late);
+    }
+}
+
+static void jitter_command(int fd, int argc, char **argv)
+{
+    if (argc > 1) {
+        latency_jitter_enabled = strcmp(argv[1], "on") == 0;
+        if (latency_jitter_enabled) {
+            if (jitter_task_handle == NULL) {
+                jitter_task_handle = task_create(jitter_task, "jitter", JITTER_STACK_SIZE, NULL, 13);
+            }
+            xTaskNotifyGive(jitter_task_handle);
+        }
+    }
+    control_printf(fd, "jitter: %s\n", latency_jitter_enabled ? "on" : "off");
+}
+
+static void latency_command(int fd, int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+        taskENTER_CRITICAL(&histograms_lock);
+        memset(histograms, 0, sizeof(histograms));
+        taskEXIT_CRITICAL(&histograms_lock);
+        return;
+    }
+
+    for (int hop = 0; hop < LATENCY_NUM_HOPS; hop++) {
+        latency_histogram_t h;
+        taskENTER_CRITICAL(&histograms_lock);
+        h = histograms[hop];
+        taskEXIT_CRITICAL(&histograms_lock);
+
+        control_printf(fd, "%s: n=%lu avg=%lluus max=%luus",
+            hop_names[hop],
+            (unsigned long)h.count,
+            h.count ? (unsigned long long)(h.sum_us / h.count) : 0ULL,
+            (unsigned long)h.max_us);
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            if (h.buckets[i]) {
+                control_printf(fd, " <%luus:%lu", 1UL << i, (unsigned long)h.buckets[i]);
+            }
+        }
+        control_printf(fd, "\n");
+    }
+}
+
+void latency_init(void)
+{
+    control_register("latency", "[reset] per-hop latency histograms", latency_command);
+    control_register("jitter", "[on|off] measure stm32 tx jitter and bridge core wakeups", jitter_command);
+}
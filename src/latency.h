@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_timer.h"
+
+// Per-hop latency histograms.
+//
+// Data is tagged with latency_now() when it enters the bridge (usb rx, tcp/udp rx, uart rx)
+// and the tag travels with it through the fanout buffers. Each hop records the time
+// since that tag, or the time it spent itself.
+// Query with the "latency" command on the control port.
+
+typedef enum {
+    LATENCY_USB_RX_QUEUE,       // usb rx -> picked up by the mux
+    LATENCY_TCP_RX_QUEUE,       // tcp rx -> picked up by the mux
+    LATENCY_UDP_RX_QUEUE,       // udp rx -> picked up by the mux
+    LATENCY_MUX,                // mux pick up -> written to the stm32 tx buffer
+    LATENCY_STM_TX,             // usb/tcp rx -> handed to the uart driver
+    LATENCY_USB_TX,             // uart rx -> usb write done
+    LATENCY_TCP_TX,             // uart rx -> tcp send done
+    LATENCY_UDP_TX,             // uart rx -> udp datagram sent
+    LATENCY_STM_TX_GAP,         // stm32 tx line idle although data was waiting
+    // jitter mode only ("jitter on"):
+    LATENCY_STM_TX_JITTER,      // change of the spacing between chunks from host rx to uart write
+    LATENCY_WAKEUP,             // how late a periodic task on the bridge core wakes up
+    LATENCY_STM_TX_URGENT,      // usb/tcp rx -> urgent lane frame handed to the uart driver
+    LATENCY_SCHEDULE,           // timed command due -> released towards the stm32
+    LATENCY_SCHEDULE_QUEUE,     // timed command released -> picked up by the mux
+    LATENCY_NUM_HOPS,
+} latency_hop_t;
+
+// microseconds, wraps after ~71 minutes which is fine for differences.
+static inline uint32_t latency_now(void)
+{
+    return (uint32_t)esp_timer_get_time();
+}
+
+void latency_init(void);
+
+void latency_record(latency_hop_t hop, uint32_t us);
+
+// highest latency of a hop since the previous call, for the power governor.
+uint32_t latency_take_max(latency_hop_t hop);
+
+// Jitter mode: records how much the bridge distorts the host's command cadence, and
+// runs a probe task on the bridge core. Off by default, it costs a little cpu.
+extern volatile bool latency_jitter_enabled;
+
+// called by the uart tx path for every chunk: when it entered the bridge and when it was written.
+void latency_record_cadence(uint32_t arrived, uint32_t sent);
+
+static inline void latency_record_since(latency_hop_t hop, uint32_t timestamp)
+{
+    latency_record(hop, latency_now() - timestamp);
+}
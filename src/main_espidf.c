@@ -19,80 +19,22 @@
 #include "lwip/sys.h"
 #include <lwip/netdb.h>
 
-#include "usb_serial.h"
-#include "uart.h"
-#include "tcp_server.h"
+#include "bridge.h"
 #include "wifi.h"
 #include "boot_led.h"
 #include "i2c_slave.h"
+#include "ota.h"
+#include "boot_time.h"
 
 
-RingbufHandle_t usb_serial_rx;
-RingbufHandle_t usb_serial_tx;
-
-RingbufHandle_t stm_serial_rx;
-RingbufHandle_t stm_serial_tx;
-
-RingbufHandle_t tcp_rx;
-RingbufHandle_t tcp_tx;
-
-
-typedef struct {
-    RingbufHandle_t in;
-    RingbufHandle_t out1;
-    RingbufHandle_t out2;
-    const char* tag;
-} RingbufferForwardParameters;
-
-static void ringbuffer_forward_task(void *pvParameters) {
-    RingbufferForwardParameters params = *(RingbufferForwardParameters*)pvParameters;
-
-    while (1) {
-        //Receive data from byte buffer
-        size_t len;
-        char *data = (char *)xRingbufferReceiveUpTo(params.in, &len, pdMS_TO_TICKS(1000), 1000);
-
-        //Check received data
-        if (data != NULL) {
-            // ESP_LOGI(params.tag, "write %d bytes", len);
-
-            UBaseType_t res = xRingbufferSend(params.out1, data, len, pdMS_TO_TICKS(1000));
-            if (res != pdTRUE) {
-                ESP_LOGW(params.tag, "Failed to send item");
-            }
-
-            if (params.out2) {
-                UBaseType_t res = xRingbufferSend(params.out2, data, len, pdMS_TO_TICKS(1000));
-                if (res != pdTRUE) {
-                    ESP_LOGW(params.tag, "Failed to send item (2)");
-                }
-            }
-
-            //Return Item
-            vRingbufferReturnItem(params.in, (void *)data);
-        } else {
-            //Failed to receive item
-            // printf("Failed to receive item\n");
-        }
-    }
-}
-
-void forward(const char* taskname, RingbufHandle_t rx, RingbufHandle_t tx1, RingbufHandle_t tx2) {
-    // LEAK!!
-    RingbufferForwardParameters* params = malloc(sizeof(RingbufferForwardParameters));
-    params->in = rx;
-    params->out1 = tx1;
-    params->out2 = tx2;
-    params->tag = taskname;
-    xTaskCreate(ringbuffer_forward_task, taskname, 4096, (void*)params, 5, NULL);
-}
-
 void init_power_management() {
     // from usb 5v, no wifi, esp32 reset
     // 160 / 160 / dis:  110mw
     // 160 / 40  / dis:  65mw
     // 160 / 10  / dis:  51mw
     //  40 / 10  / dis:  52mw
+    // DFS is left free here, the power governor (power.c) holds the cpu at max frequency
+    // and switches the wifi modem out of power save only while there is traffic.
 
     esp_pm_config_t config = {
         .max_freq_mhz = 160,
@@ -114,8 +56,15 @@ void app_main(void)
     //     esp_deep_sleep(1000000 * 1000); // 1000 seconds
     // }
 
+    boot_time_mark("app_main");
     init_boot_led();
+
+    // the USB <-> stm32 path first, it needs neither NVS nor WiFi and forwards while they start
+    bridge_start();
+    boot_time_mark("bridge");
+
     init_power_management();
+    boot_time_mark("power management");
 
     // // drive stm32 NRST pin low to power down the chip. Useful for power measurements.
     // gpio_config_t io_conf = {};
@@ -135,34 +84,17 @@ void app_main(void)
         ret = nvs_flash_init();
     }
     ESP_ERROR_CHECK(ret);
-
-    //Create ring buffers
-    usb_serial_rx = xRingbufferCreate(1000, RINGBUF_TYPE_BYTEBUF);
-    usb_serial_tx = xRingbufferCreate(1000, RINGBUF_TYPE_BYTEBUF);
-    stm_serial_rx = xRingbufferCreate(1000, RINGBUF_TYPE_BYTEBUF);
-    stm_serial_tx = xRingbufferCreate(1000, RINGBUF_TYPE_BYTEBUF);
-    tcp_rx = xRingbufferCreate(1000, RINGBUF_TYPE_BYTEBUF);
-    tcp_tx = xRingbufferCreate(16000, RINGBUF_TYPE_BYTEBUF);
-    assert(usb_serial_rx);
-    assert(usb_serial_tx);
-    assert(stm_serial_rx);
-    assert(stm_serial_tx);
-    assert(tcp_rx);
-    assert(tcp_tx);
+    boot_time_mark("nvs");
 
     init_i2c_slave();
+    boot_time_mark("i2c");
 
-    create_usb_serial_task(usb_serial_rx, usb_serial_tx);
-    create_stm32_serial_task(stm_serial_rx, stm_serial_tx);
     wifi_init_sta();
-    create_tcp_server_task(tcp_rx, tcp_tx);
-
-    // write all incoming bytes on USB serial to stm32
-    forward("fw usb->stm", usb_serial_rx, stm_serial_tx, NULL);
-    // write all incoming bytes on tcp socket to stm32
-    forward("fw tcp->stm", tcp_rx, stm_serial_tx, NULL);
-    // write all incoming bytes from the stm32 to both USB serial and TCP sockets
-    forward("fw stm->usb + tcp", stm_serial_rx, usb_serial_tx, tcp_tx);
+    boot_time_mark("wifi started");
+    // registers its control command, so before the control server starts
+    create_ota_task();
+    bridge_start_network();
+    boot_time_mark("network");
 
     // Disable logging to prevent interruptions in restim data stream.
     esp_log_set_level_master(ESP_LOG_NONE);
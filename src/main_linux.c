@@ -0,0 +1,23 @@
+#include <stdio.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+#include "esp_log.h"
+
+#include "bridge.h"
+#include "boot_time.h"
+
+
+// Native build of the bridge core for the ESP-IDF linux target, with the
+// UART, USB serial and TCP endpoints simulated as described in port.h.
+void app_main(void)
+{
+    boot_time_mark("app_main");
+    bridge_start();
+    boot_time_mark("bridge");
+    bridge_start_network();
+    boot_time_mark("network");
+
+    // Disable logging, same as on the device. The simulated USB serial may be stdout.
+    esp_log_set_level_master(ESP_LOG_NONE);
+}
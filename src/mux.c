@@ -0,0 +1,422 @@
+#include "mux.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+#include "esp_log.h"
+
+#include "coalesce.h"
+#include "control.h"
+#include "power.h"
+#include "tasks.h"
+
+#define STACK_SIZE          (4096)
+// bytes a source may forward per turn, always rounded up to the end of the frame.
+#define MUX_QUANTUM         256
+// a source that started a frame keeps its lane for at most this long without sending more.
+#define MUX_FRAME_TIMEOUT_MS    20
+#define MUX_MAX_URGENT_TYPES    8
+
+typedef struct {
+    fanout_reader_t *in;
+    const char *name;
+    latency_hop_t queue_hop;
+    bool urgent;            // all frames from this source take the urgent lane
+    bool in_frame;
+    int lane;               // of the frame in progress
+    TickType_t last_data;
+    // coalescing: the frame being collected
+    uint8_t frame[COALESCE_MAX_FRAME_LEN];
+    size_t frame_len;
+    bool frame_complete;
+    uint32_t frame_timestamp;
+    uint32_t bytes;
+    uint32_t frames;
+    uint32_t urgent_frames;
+    uint32_t timeouts;
+    uint32_t oversize;
+} mux_source_t;
+
+static const char *lane_names[MUX_NUM_LANES] = {
+    [MUX_LANE_URGENT] = "urgent",
+    [MUX_LANE_BULK] = "bulk",
+};
+
+static mux_source_t sources[MUX_MAX_SOURCES];
+static int num_sources = 0;
+static fanout_t *mux_out[MUX_NUM_LANES];
+// the source in the middle of a frame on each lane, or -1. Frames on a lane never interleave.
+static int lane_owner[MUX_NUM_LANES] = {-1, -1};
+static volatile int mux_delimiter;
+// frames with one of these bytes at urgent_offset take the urgent lane, -1 for none.
+static volatile int urgent_offset = -1;
+static uint8_t urgent_types[MUX_MAX_URGENT_TYPES];
+static volatile int num_urgent_types = 0;
+// the source whose turn it is
+static int mux_next = 0;
+// data was left in a source because its lane was full or taken
+static bool mux_blocked = false;
+
+
+void mux_add_source(fanout_t *in, const char *name, latency_hop_t queue_hop)
+{
+    assert(num_sources < MUX_MAX_SOURCES);
+    mux_source_t *source = &sources[num_sources];
+    source->in = fanout_add_reader(in, name);
+    source->name = name;
+    source->queue_hop = queue_hop;
+    assert(source->in);
+    num_sources++;
+}
+
+void mux_set_source_urgent(const char *name, bool urgent)
+{
+    for (int i = 0; i < num_sources; i++) {
+        if (strcmp(sources[i].name, name) == 0) {
+            sources[i].urgent = urgent;
+        }
+    }
+}
+
+static int mux_classify(mux_source_t *source, const uint8_t *frame, size_t len)
+{
+    if (source->urgent) {
+        return MUX_LANE_URGENT;
+    }
+    int offset = urgent_offset;
+    if (offset >= 0 && offset < len) {
+        for (int i = 0; i < num_urgent_types; i++) {
+            if (frame[offset] == urgent_types[i]) {
+                return MUX_LANE_URGENT;
+            }
+        }
+    }
+    return MUX_LANE_BULK;
+}
+
+static size_t mux_collect(int id);
+
+// forward whole frames from one source, returns the number of bytes forwarded.
+// Nothing blocks: a frame that doesn't fit continues on the next turn, and keeps its lane
+// to itself until then.
+static size_t mux_turn(int id)
+{
+    mux_source_t *source = &sources[id];
+    if (mux_delimiter != MUX_NO_DELIMITER && !source->in_frame
+            && (coalesce_active() || source->frame_len > 0)) {
+        return mux_collect(id);
+    }
+
+    size_t sent = 0;
+    while (sent < MUX_QUANTUM || source->in_frame) {
+        size_t len;
+        const uint8_t *data = fanout_read_begin(source->in, &len, MUX_QUANTUM, 0);
+        if (data == NULL) {
+            if (source->in_frame
+                    && xTaskGetTickCount() - source->last_data >= pdMS_TO_TICKS(MUX_FRAME_TIMEOUT_MS)) {
+                // incomplete frame, give up the lane. The stm32 drops it when the next frame starts.
+                source->in_frame = false;
+                lane_owner[source->lane] = -1;
+                source->timeouts++;
+            }
+            break;
+        }
+
+        if (!source->in_frame) {
+            // a frame can only be classified by what arrived of it so far
+            source->lane = mux_classify(source, data, len);
+            if (lane_owner[source->lane] >= 0) {
+                fanout_read_end(source->in, 0);
+                mux_blocked = true;
+                break;
+            }
+        }
+        fanout_t *out = mux_out[source->lane];
+        len = MIN(len, fanout_free(out));
+        if (len == 0) {
+            fanout_read_end(source->in, 0);
+            mux_blocked = true;
+            break;
+        }
+
+        power_host_activity(len);
+        uint32_t picked_up = latency_now();
+        uint32_t timestamp;
+        if (fanout_read_timestamp(source->in, &timestamp)) {
+            latency_record(source->queue_hop, picked_up - timestamp);
+        } else {
+            timestamp = picked_up;
+        }
+
+        bool complete = true;
+        int delimiter = mux_delimiter;
+        if (delimiter != MUX_NO_DELIMITER) {
+            const uint8_t *end = memchr(data, delimiter, len);
+            complete = end != NULL;
+            if (end) {
+                len = end - data + 1;
+            }
+        }
+
+        // keep the original timestamp, so the uart tx task can measure end-to-end latency.
+        fanout_write(out, data, len, timestamp, 0);
+        latency_record_since(LATENCY_MUX, picked_up);
+        fanout_read_end(source->in, len);
+
+        sent += len;
+        source->bytes += len;
+        source->in_frame = !complete;
+        lane_owner[source->lane] = complete ? -1 : id;
+        source->last_data = xTaskGetTickCount();
+        if (complete) {
+            source->frames++;
+            if (source->lane == MUX_LANE_URGENT) {
+                source->urgent_frames++;
+            }
+        }
+    }
+    return sent;
+}
+
+// hand a collected frame on: urgent frames go straight out, the rest into the coalescing table.
+static bool mux_deliver(mux_source_t *source)
+{
+    if (mux_classify(source, source->frame, source->frame_len) == MUX_LANE_URGENT) {
+        fanout_t *out = mux_out[MUX_LANE_URGENT];
+        if (lane_owner[MUX_LANE_URGENT] >= 0 || fanout_free(out) < source->frame_len) {
+            return false;
+        }
+        fanout_write(out, source->frame, source->frame_len, source->frame_timestamp, 0);
+        source->urgent_frames++;
+    } else if (!coalesce_put(source->frame, source->frame_len, source->frame_timestamp)) {
+        return false;
+    }
+    source->frames++;
+    return true;
+}
+
+// coalescing: collect whole frames from one source into the coalescing table.
+// Every source has its own frame buffer, so sources don't have to wait for each other.
+static size_t mux_collect(int id)
+{
+    mux_source_t *source = &sources[id];
+    size_t taken = 0;
+
+    while (taken < MUX_QUANTUM) {
+        if (source->frame_complete) {
+            if (!mux_deliver(source)) {
+                // table or lane full, the source backs up meanwhile
+                mux_blocked = true;
+                break;
+            }
+            source->frame_complete = false;
+            source->frame_len = 0;
+        }
+
+        size_t len;
+        const uint8_t *data = fanout_read_begin(source->in, &len, MUX_QUANTUM, 0);
+        if (data == NULL) {
+            if (source->frame_len > 0
+                    && xTaskGetTickCount() - source->last_data >= pdMS_TO_TICKS(MUX_FRAME_TIMEOUT_MS)) {
+                // incomplete frame, the stm32 would drop it anyway.
+                source->frame_len = 0;
+                source->timeouts++;
+            }
+            break;
+        }
+
+        if (source->frame_len == 0) {
+            uint32_t picked_up = latency_now();
+            if (fanout_read_timestamp(source->in, &source->frame_timestamp)) {
+                latency_record(source->queue_hop, picked_up - source->frame_timestamp);
+            } else {
+                source->frame_timestamp = picked_up;
+            }
+        }
+
+        const uint8_t *end = memchr(data, mux_delimiter, len);
+        size_t n = end ? end - data + 1 : len;
+        if (source->frame_len + n > COALESCE_MAX_FRAME_LEN) {
+            // too long to hold, forward what we have and stream the rest of the frame.
+            int lane = source->frame_len
+                ? mux_classify(source, source->frame, source->frame_len)
+                : mux_classify(source, data, len);
+            fanout_t *out = mux_out[lane];
+            fanout_read_end(source->in, 0);
+            if (lane_owner[lane] >= 0 || fanout_free(out) < source->frame_len) {
+                mux_blocked = true;
+                break;
+            }
+            if (source->frame_len) {
+                fanout_write(out, source->frame, source->frame_len, source->frame_timestamp, 0);
+            }
+            source->frame_len = 0;
+            source->lane = lane;
+            source->in_frame = true;
+            lane_owner[lane] = id;
+            source->last_data = xTaskGetTickCount();
+            source->oversize++;
+            return taken + mux_turn(id);
+        }
+
+        power_host_activity(n);
+        memcpy(source->frame + source->frame_len, data, n);
+        fanout_read_end(source->in, n);
+        source->frame_len += n;
+        source->frame_complete = end != NULL;
+        source->last_data = xTaskGetTickCount();
+        source->bytes += n;
+        taken += n;
+    }
+    return taken;
+}
+
+// something only a timeout or a draining lane moves on, nothing will notify the mux about it.
+static bool mux_waiting(void)
+{
+    if (mux_blocked || coalesce_pending()) {
+        return true;
+    }
+    for (int i = 0; i < MUX_NUM_LANES; i++) {
+        if (lane_owner[i] >= 0) {
+            return true;
+        }
+    }
+    for (int i = 0; i < num_sources; i++) {
+        if (sources[i].frame_len > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void mux_wake(void *arg)
+{
+    xTaskNotifyGive((TaskHandle_t)arg);
+}
+
+static void mux_task(void *pvParameters)
+{
+    for (int i = 0; i < num_sources; i++) {
+        fanout_reader_set_notify(sources[i].in, mux_wake, xTaskGetCurrentTaskHandle());
+    }
+
+    while (1) {
+        if (mux_poll() == 0) {
+            // a full round without data. Anything written since the round started
+            // has left a notification, so this can't miss it. Full lanes, unfinished
+            // frames and held back frames are looked at again on the next tick.
+            ulTaskNotifyTake(pdTRUE, mux_waiting() ? 1 : portMAX_DELAY);
+        }
+    }
+}
+
+static void mux_command(int fd, int argc, char **argv)
+{
+    if (argc >= 3 && strcmp(argv[1], "delimiter") == 0) {
+        mux_delimiter = strcmp(argv[2], "none") == 0 ? MUX_NO_DELIMITER : (int)(strtoul(argv[2], NULL, 0) & 0xFF);
+    } else if (argc >= 3 && strcmp(argv[1], "urgent") == 0) {
+        if (strcmp(argv[2], "off") == 0) {
+            urgent_offset = -1;
+        } else {
+            // urgent <offset> <type> [<type>...]
+            num_urgent_types = 0;
+            for (int i = 3; i < argc && num_urgent_types < MUX_MAX_URGENT_TYPES; i++) {
+                urgent_types[num_urgent_types++] = strtoul(argv[i], NULL, 0) & 0xFF;
+            }
+            urgent_offset = strtoul(argv[2], NULL, 0);
+        }
+    } else if (argc >= 4 && strcmp(argv[1], "urgent-source") == 0) {
+        mux_set_source_urgent(argv[2], strcmp(argv[3], "on") == 0);
+    }
+
+    if (mux_delimiter == MUX_NO_DELIMITER) {
+        control_printf(fd, "delimiter: none\n");
+    } else {
+        control_printf(fd, "delimiter: 0x%02x\n", mux_delimiter);
+    }
+    if (urgent_offset < 0) {
+        control_printf(fd, "urgent types: none\n");
+    } else {
+        control_printf(fd, "urgent types at offset %d:", urgent_offset);
+        for (int i = 0; i < num_urgent_types; i++) {
+            control_printf(fd, " 0x%02x", urgent_types[i]);
+        }
+        control_printf(fd, "\n");
+    }
+    for (int i = 0; i < MUX_NUM_LANES; i++) {
+        control_printf(fd, "%s lane: used=%lu/%lu\n", lane_names[i],
+            (unsigned long)(fanout_size(mux_out[i]) - fanout_free(mux_out[i])), (unsigned long)fanout_size(mux_out[i]));
+    }
+    for (int i = 0; i < num_sources; i++) {
+        mux_source_t *source = &sources[i];
+        control_printf(fd, "%s%s: bytes=%lu frames=%lu urgent=%lu timeouts=%lu oversize=%lu\n", source->name,
+            source->urgent ? " (urgent)" : "",
+            (unsigned long)source->bytes, (unsigned long)source->frames, (unsigned long)source->urgent_frames,
+            (unsigned long)source->timeouts, (unsigned long)source->oversize);
+    }
+}
+
+static void mux_setup(fanout_t *out[MUX_NUM_LANES], int delimiter)
+{
+    assert(num_sources > 0);
+    for (int i = 0; i < MUX_NUM_LANES; i++) {
+        mux_out[i] = out[i];
+    }
+    mux_delimiter = delimiter;
+
+    control_register("mux", "[delimiter <byte>|none|urgent <offset> <type>...|urgent off|urgent-source <name> on|off] "
+        "per source counters, framing and lanes", mux_command);
+    coalesce_init();
+}
+
+void create_mux_task(fanout_t *out[MUX_NUM_LANES], int delimiter)
+{
+    mux_setup(out, delimiter);
+
+    task_create(mux_task, "mux", STACK_SIZE, NULL, 5);
+}
+
+void mux_init_polled(fanout_t *out[MUX_NUM_LANES], int delimiter, fanout_notify_t notify, void *arg)
+{
+    mux_setup(out, delimiter);
+
+    for (int i = 0; i < num_sources; i++) {
+        fanout_reader_set_notify(sources[i].in, notify, arg);
+    }
+}
+
+size_t mux_poll(void)
+{
+    mux_blocked = false;
+    size_t sent = 0;
+    for (int i = 0; i < num_sources; i++) {
+        sent += mux_turn(mux_next);
+        mux_next = (mux_next + 1) % num_sources;
+    }
+    if (coalesce_pending() && lane_owner[MUX_LANE_BULK] < 0) {
+        // held back frames are bulk, and must not go into the middle of a streamed one
+        sent += coalesce_release(mux_out[MUX_LANE_BULK]);
+    }
+    return sent;
+}
+
+int mux_get_delimiter(void)
+{
+    return mux_delimiter;
+}
+
+bool mux_frame_boundary(const uint8_t *data, size_t len)
+{
+    int delimiter = mux_delimiter;
+    return delimiter == MUX_NO_DELIMITER || (len > 0 && data[len - 1] == delimiter);
+}
+
+const uint8_t *mux_frame_end(const uint8_t *data, size_t len)
+{
+    int delimiter = mux_delimiter;
+    return delimiter == MUX_NO_DELIMITER ? NULL : memchr(data, delimiter, len);
+}
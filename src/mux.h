@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "fanout.h"
+#include "latency.h"
+
+#define MUX_MAX_SOURCES     8
+// default frame delimiter: the HDLC flag byte that ends every message to the stm32.
+#define MUX_DELIMITER       0x7E
+#define MUX_NO_DELIMITER    (-1)
+
+// Frame-atomic multiplexer from several host sources into the stm32 tx buffer.
+//
+// Each source is split at the delimiter byte, and once a source has started a frame
+// the mux stays with it until the frame is complete. Frames from different sources
+// therefore never interleave. Sources take turns, each turn forwards whole frames
+// up to a byte quantum, so a busy source can't starve the others.
+//
+// A source that stops in the middle of a frame loses its turn after a timeout,
+// the stm32 resyncs on the next delimiter.
+//
+// Without a delimiter (MUX_NO_DELIMITER) sources are interleaved per chunk as received.
+//
+// Output goes to one of MUX_NUM_LANES buffers, picked per frame when it starts: frames
+// from a source marked urgent, or with a configured type byte at a fixed offset, take the
+// urgent lane, everything else the bulk lane. The uart sends the urgent lane first, so a
+// stop command doesn't queue behind kilobytes of parameter uploads. Frames of one source
+// on the same lane stay in order, an urgent frame may overtake the source's bulk frames.
+
+#define MUX_LANE_URGENT     0
+#define MUX_LANE_BULK       1
+#define MUX_NUM_LANES       2
+
+// Add a reader on `in` as source. Only call before create_mux_task().
+void mux_add_source(fanout_t *in, const char *name, latency_hop_t queue_hop);
+
+// Send all frames of the source through the urgent lane, same as "mux urgent-source".
+void mux_set_source_urgent(const char *name, bool urgent);
+
+// The mux task is the only producer of the `out` lanes.
+void create_mux_task(fanout_t *out[MUX_NUM_LANES], int delimiter);
+
+// Event loop engine (BRIDGE_EVENT_LOOP): the same mux without its task.
+// `notify` is called whenever a source has new data.
+void mux_init_polled(fanout_t *out[MUX_NUM_LANES], int delimiter, fanout_notify_t notify, void *arg);
+// Forward what the sources have without waiting, one turn per source.
+// Returns the number of bytes forwarded.
+size_t mux_poll(void);
+
+// The delimiter in use, changed at runtime with "mux delimiter". Everything that cuts the
+// stream into frames (uart lanes, usb and tcp boundaries) follows it. Without a delimiter
+// there are no frames, every chunk counts as complete.
+int mux_get_delimiter(void);
+
+// true if a chunk ending with `data[len - 1]` ends a frame
+bool mux_frame_boundary(const uint8_t *data, size_t len);
+
+// the first delimiter in `data`, NULL if there is none or no delimiter is set
+const uint8_t *mux_frame_end(const uint8_t *data, size_t len);
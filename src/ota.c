@@ -0,0 +1,237 @@
+#include "ota.h"
+
+#include <string.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_app_desc.h"
+#include "mbedtls/sha256.h"
+
+#include "port.h"
+#include "wifi.h"
+#include "control.h"
+#include "tasks.h"
+
+#define STACK_SIZE              (4096)
+// one TCP segment, written to flash as it arrives
+#define CHUNK_SIZE              1460
+#define UPLOAD_TIMEOUT_MS       5000
+// time for the last reply to leave before the restart
+#define RESTART_DELAY_MS        500
+
+static const char *TAG = "ota";
+
+// progress, for the "ota" command
+static const char *volatile status = "idle";
+static volatile uint32_t progress_done;
+static volatile uint32_t progress_total;
+
+
+static bool recv_all(int sock, void *data, size_t len)
+{
+    uint8_t *dst = data;
+    while (len > 0) {
+        if (!port_wait_readable(sock, pdMS_TO_TICKS(UPLOAD_TIMEOUT_MS))) {
+            return false;
+        }
+        int n = recv(sock, dst, len, 0);
+        if (n <= 0) {
+            return false;
+        }
+        dst += n;
+        len -= n;
+    }
+    return true;
+}
+
+// stream the image into the inactive slot, NULL on success
+static const char *ota_receive(int sock, const ota_header_t *header, const esp_partition_t *slot)
+{
+    static uint8_t buf[CHUNK_SIZE];
+    esp_ota_handle_t handle;
+    // sequential writes: sectors are erased as the image reaches them, not all up front
+    if (esp_ota_begin(slot, OTA_WITH_SEQUENTIAL_WRITES, &handle) != ESP_OK) {
+        return "ota begin failed";
+    }
+
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+
+    const char *error = NULL;
+    uint32_t reported = 0;
+    for (size_t offset = 0; offset < header->size;) {
+        size_t len = MIN(sizeof(buf), header->size - offset);
+        if (!recv_all(sock, buf, len)) {
+            error = "upload failed";
+            break;
+        }
+        if (esp_ota_write(handle, buf, len) != ESP_OK) {
+            error = "flash write failed";
+            break;
+        }
+        mbedtls_sha256_update(&sha, buf, len);
+        offset += len;
+        progress_done = offset;
+        if (progress_done * 10 / header->size != reported) {
+            reported = progress_done * 10 / header->size;
+            control_printf(sock, "write %lu/%lu\n", (unsigned long)progress_done, (unsigned long)header->size);
+        }
+    }
+
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&sha, digest);
+    mbedtls_sha256_free(&sha);
+    if (error) {
+        esp_ota_abort(handle);
+        return error;
+    }
+    if (memcmp(digest, header->sha256, sizeof(digest)) != 0) {
+        esp_ota_abort(handle);
+        return "sha256 mismatch";
+    }
+    // checks the image header and segments
+    if (esp_ota_end(handle) != ESP_OK) {
+        return "image invalid";
+    }
+    if (esp_ota_set_boot_partition(slot) != ESP_OK) {
+        return "set boot partition failed";
+    }
+    return NULL;
+}
+
+static void ota_upload(int sock)
+{
+    ota_header_t header;
+    if (!recv_all(sock, &header, sizeof(header)) || memcmp(header.magic, OTA_MAGIC, 4) != 0) {
+        control_printf(sock, "error: bad header\n");
+        return;
+    }
+    const esp_partition_t *slot = esp_ota_get_next_update_partition(NULL);
+    if (slot == NULL) {
+        control_printf(sock, "error: no ota slot\n");
+        return;
+    }
+    if (header.size == 0 || header.size > slot->size) {
+        control_printf(sock, "error: image size\n");
+        return;
+    }
+
+    ESP_LOGI(TAG, "receiving %lu bytes into %s", (unsigned long)header.size, slot->label);
+    status = "upload";
+    progress_done = 0;
+    progress_total = header.size;
+    const char *error = ota_receive(sock, &header, slot);
+    status = error ? error : "restart";
+    if (error) {
+        ESP_LOGE(TAG, "%s", error);
+        control_printf(sock, "error: %s\n", error);
+        return;
+    }
+
+    control_printf(sock, "ok\n");
+    shutdown(sock, SHUT_WR);
+    vTaskDelay(pdMS_TO_TICKS(RESTART_DELAY_MS));
+    esp_restart();
+}
+
+// A freshly updated image is pending verification until it has shown it can get back on
+// the network, where the next update would come from. Otherwise roll back.
+static void ota_validate(void)
+{
+    esp_ota_img_states_t state;
+    if (esp_ota_get_state_partition(esp_ota_get_running_partition(), &state) != ESP_OK
+            || state != ESP_OTA_IMG_PENDING_VERIFY) {
+        return;
+    }
+    status = "verify";
+    TickType_t start = xTaskGetTickCount();
+    while (wifi_get_ip() == 0) {
+        if (xTaskGetTickCount() - start > pdMS_TO_TICKS(OTA_VALIDATE_TIMEOUT_MS)) {
+            ESP_LOGE(TAG, "no network, rolling back");
+            esp_ota_mark_app_invalid_rollback_and_reboot();
+        }
+        vTaskDelay(pdMS_TO_TICKS(100));
+    }
+    esp_ota_mark_app_valid_cancel_rollback();
+    ESP_LOGI(TAG, "update confirmed");
+    status = "idle";
+}
+
+static void ota_task(void *pvParameters)
+{
+    ota_validate();
+
+    struct sockaddr_in dest_addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(OTA_PORT),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+
+    int listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    if (listen_sock < 0) {
+        ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
+        vTaskDelete(NULL);
+        return;
+    }
+    int opt = 1;
+    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    if (bind(listen_sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) != 0
+            || listen(listen_sock, 1) != 0) {
+        ESP_LOGE(TAG, "Unable to listen on port %d: errno %d", OTA_PORT, errno);
+        close(listen_sock);
+        vTaskDelete(NULL);
+        return;
+    }
+
+    while (1) {
+        int sock = accept(listen_sock, NULL, NULL);
+        if (sock < 0) {
+            ESP_LOGE(TAG, "Unable to accept connection: errno %d", errno);
+            continue;
+        }
+        // an upload that stalls doesn't hold the port forever
+        struct timeval timeout = {.tv_sec = UPLOAD_TIMEOUT_MS / 1000};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        ota_upload(sock);
+        shutdown(sock, 0);
+        close(sock);
+    }
+}
+
+static const char *ota_state_name(esp_ota_img_states_t state)
+{
+    switch (state) {
+    case ESP_OTA_IMG_NEW:               return "new";
+    case ESP_OTA_IMG_PENDING_VERIFY:    return "pending verify";
+    case ESP_OTA_IMG_VALID:             return "valid";
+    case ESP_OTA_IMG_INVALID:           return "invalid";
+    case ESP_OTA_IMG_ABORTED:           return "aborted";
+    default:                            return "undefined";
+    }
+}
+
+static void ota_command(int fd, int argc, char **argv)
+{
+    const esp_app_desc_t *app = esp_app_get_description();
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    const esp_partition_t *next = esp_ota_get_next_update_partition(NULL);
+    esp_ota_img_states_t state = ESP_OTA_IMG_UNDEFINED;
+    esp_ota_get_state_partition(running, &state);
+
+    control_printf(fd, "firmware: %s\n", app->version);
+    control_printf(fd, "running: %s (%s)\n", running ? running->label : "?", ota_state_name(state));
+    control_printf(fd, "next: %s\n", next ? next->label : "none");
+    control_printf(fd, "status: %s %lu/%lu\n", status, (unsigned long)progress_done, (unsigned long)progress_total);
+}
+
+void create_ota_task(void)
+{
+    control_register("ota", "firmware slots and update progress", ota_command);
+
+    task_create(ota_task, "ota", STACK_SIZE, NULL, 5);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+
+// Firmware update of the esp32 itself over WiFi, into the inactive one of two app slots.
+//
+// Upload: connect to TCP port OTA_PORT and send an ota_header_t followed by the app image
+// (the .bin esptool would write to the app partition). Chunks are written to the slot as
+// they arrive, nothing is buffered. Once the SHA-256 matches and the image checks out, the
+// slot is made the boot slot and the esp32 restarts. Progress is reported as text lines
+// on the same connection, the last one is "ok" or "error: <reason>".
+//
+// The new firmware boots on probation: if it doesn't get an IP address within
+// OTA_VALIDATE_TIMEOUT_MS, or resets before, the bootloader goes back to the previous slot.
+
+#define OTA_PORT                55537
+#define OTA_MAGIC               "FOCO"
+#define OTA_VALIDATE_TIMEOUT_MS 60000
+
+typedef struct __attribute__((packed)) {
+    char magic[4];          // OTA_MAGIC
+    uint32_t size;
+    uint8_t sha256[32];     // of the image
+} ota_header_t;
+
+void create_ota_task(void);
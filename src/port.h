@@ -0,0 +1,87 @@
+#pragma once
+
+// Thin port layer between the bridge core and the hardware.
+//
+// On the ESP32 this pulls in the real UART, USB-serial-jtag, WiFi and lwIP headers.
+// On the ESP-IDF linux target (idf.py --preview set-target linux) port_linux.c stands
+// in for the subset of the driver API used by the bridge, backed by file descriptors:
+//
+//   UART to the stm32:  FOCSTIM_UART=<path>, e.g. one end of a socat pty pair.
+//                       Without it a pty is created and its name printed on stderr.
+//   USB serial:         FOCSTIM_USB=<path>, stdin/stdout if unset.
+//   TCP:                host sockets on the usual port.
+
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+
+#if CONFIG_IDF_TARGET_LINUX
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/select.h>
+#include <sys/eventfd.h>
+
+#include "port_linux.h"
+
+#else
+
+#include "driver/uart.h"
+#include "driver/usb_serial_jtag.h"
+#include "esp_wifi.h"
+#include "esp_system.h"
+
+#include "lwip/err.h"
+#include "lwip/sockets.h"
+#include "lwip/sys.h"
+#include <lwip/netdb.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include "esp_vfs_eventfd.h"
+
+#include "board_config.h"
+
+#endif
+
+
+#if CONFIG_IDF_TARGET_LINUX
+// Block the calling task until fd is readable or the timeout expires.
+// A host syscall that blocks would stall the FreeRTOS simulator, so this polls.
+bool port_wait_readable(int fd, TickType_t timeout);
+#else
+// lwIP blocks the calling task properly, nothing to do.
+static inline bool port_wait_readable(int fd, TickType_t timeout)
+{
+    return true;
+}
+#endif
+
+#if CONFIG_IDF_TARGET_LINUX
+// select() on readfds/writefds, for the same reason as port_wait_readable() this polls.
+int port_select(int nfds, fd_set *readfds, fd_set *writefds, TickType_t timeout);
+// eventfd for waking a select() loop from another task.
+int port_eventfd(void);
+#else
+static inline int port_select(int nfds, fd_set *readfds, fd_set *writefds, TickType_t timeout)
+{
+    uint32_t ms = pdTICKS_TO_MS(timeout);
+    struct timeval tv = {
+        .tv_sec = ms / 1000,
+        .tv_usec = (ms % 1000) * 1000,
+    };
+    return select(nfds, readfds, writefds, NULL, timeout == portMAX_DELAY ? NULL : &tv);
+}
+
+static inline int port_eventfd(void)
+{
+    // fails harmlessly if some other module registered it already
+    esp_vfs_eventfd_config_t config = ESP_VFS_EVENTD_CONFIG_DEFAULT();
+    esp_vfs_eventfd_register(&config);
+    return eventfd(0, 0);
+}
+#endif
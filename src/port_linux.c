@@ -0,0 +1,305 @@
+// Simulated endpoints for the ESP-IDF linux target, see port.h.
+#define _GNU_SOURCE
+
+#include "port.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/select.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <errno.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/ringbuf.h"
+#include "esp_log.h"
+
+#define STACK_SIZE (4096)
+// how often a usb endpoint at end of input is polled again
+#define USB_EOF_POLL_MS 10
+
+static const char *TAG = "port_linux";
+
+static int uart_fd = -1;
+static RingbufHandle_t uart_rx_ringbuf;
+static QueueHandle_t uart_event_queue;
+
+static int usb_rx_fd = -1;
+static int usb_tx_fd = -1;
+
+
+bool port_wait_readable(int fd, TickType_t timeout)
+{
+    TimeOut_t time_out;
+    vTaskSetTimeOutState(&time_out);
+
+    while (1) {
+        // hangups and errors count as readable, so the caller's read() reports them
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        if (poll(&pfd, 1, 0) > 0) {
+            return true;
+        }
+        if (xTaskCheckForTimeOut(&time_out, &timeout) == pdTRUE) {
+            return false;
+        }
+        vTaskDelay(1);
+    }
+}
+
+int port_select(int nfds, fd_set *readfds, fd_set *writefds, TickType_t timeout)
+{
+    fd_set read_in = *readfds;
+    fd_set write_in = *writefds;
+    TimeOut_t time_out;
+    vTaskSetTimeOutState(&time_out);
+
+    while (1) {
+        *readfds = read_in;
+        *writefds = write_in;
+        struct timeval tv = {0};
+        int ready = select(nfds, readfds, writefds, NULL, &tv);
+        if (ready != 0) {
+            return ready;
+        }
+        if (xTaskCheckForTimeOut(&time_out, &timeout) == pdTRUE) {
+            return 0;
+        }
+        vTaskDelay(1);
+    }
+}
+
+int port_eventfd(void)
+{
+    return eventfd(0, EFD_NONBLOCK);
+}
+
+static int write_all(int fd, const void *src, size_t size, TickType_t ticks_to_wait)
+{
+    const uint8_t *data = (const uint8_t *)src;
+    size_t written = 0;
+    TimeOut_t time_out;
+    vTaskSetTimeOutState(&time_out);
+
+    while (written < size) {
+        ssize_t len = write(fd, data + written, size - written);
+        if (len > 0) {
+            written += len;
+            continue;
+        }
+        if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            // other end not connected, drop the data like an unconnected wire would.
+            break;
+        }
+        if (xTaskCheckForTimeOut(&time_out, &ticks_to_wait) == pdTRUE) {
+            break;
+        }
+        vTaskDelay(1);
+    }
+    return written;
+}
+
+
+/* UART to the stm32 */
+
+static int open_uart_endpoint(void)
+{
+    const char *path = getenv("FOCSTIM_UART");
+    if (path) {
+        return open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    }
+
+    int fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0) {
+        return -1;
+    }
+    fprintf(stderr, "stm32 uart: %s\n", ptsname(fd));
+    return fd;
+}
+
+// plays the role of the UART ISR: move bytes from the fd into the driver buffer and post events.
+static void uart_sim_rx_task(void *pvParameters)
+{
+    uint8_t buf[256];
+
+    while (1) {
+        port_wait_readable(uart_fd, portMAX_DELAY);
+        ssize_t len = read(uart_fd, buf, sizeof(buf));
+        if (len <= 0) {
+            // nothing attached to the other end yet
+            vTaskDelay(pdMS_TO_TICKS(10));
+            continue;
+        }
+
+        uart_event_t event = {
+            .type = UART_DATA,
+            .size = len,
+        };
+        if (xRingbufferSend(uart_rx_ringbuf, buf, len, 0) != pdTRUE) {
+            event.type = UART_BUFFER_FULL;
+        }
+        if (uart_event_queue) {
+            xQueueSend(uart_event_queue, &event, 0);
+        }
+    }
+}
+
+esp_err_t uart_driver_install(uart_port_t uart_num, int rx_buffer_size, int tx_buffer_size, int queue_size, QueueHandle_t *uart_queue, int intr_alloc_flags)
+{
+    uart_fd = open_uart_endpoint();
+    if (uart_fd < 0) {
+        ESP_LOGE(TAG, "Unable to open uart endpoint: errno %d", errno);
+        return ESP_FAIL;
+    }
+
+    uart_rx_ringbuf = xRingbufferCreate(rx_buffer_size, RINGBUF_TYPE_BYTEBUF);
+    if (uart_rx_ringbuf == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (uart_queue) {
+        uart_event_queue = xQueueCreate(queue_size, sizeof(uart_event_t));
+        *uart_queue = uart_event_queue;
+    }
+
+    xTaskCreate(uart_sim_rx_task, "uart sim", STACK_SIZE, NULL, 10, NULL);
+    return ESP_OK;
+}
+
+esp_err_t uart_param_config(uart_port_t uart_num, const uart_config_t *uart_config)
+{
+    return ESP_OK;
+}
+
+esp_err_t uart_set_rx_full_threshold(uart_port_t uart_num, int threshold)
+{
+    return ESP_OK;
+}
+
+esp_err_t uart_set_rx_timeout(uart_port_t uart_num, const uint8_t tout_thresh)
+{
+    return ESP_OK;
+}
+
+esp_err_t uart_enable_rx_intr(uart_port_t uart_num)
+{
+    return ESP_OK;
+}
+
+esp_err_t uart_set_pin(uart_port_t uart_num, int tx_io_num, int rx_io_num, int rts_io_num, int cts_io_num)
+{
+    return ESP_OK;
+}
+
+int uart_read_bytes(uart_port_t uart_num, void *buf, uint32_t length, TickType_t ticks_to_wait)
+{
+    uint8_t *dst = (uint8_t *)buf;
+    uint32_t copied = 0;
+    TimeOut_t time_out;
+    vTaskSetTimeOutState(&time_out);
+
+    while (copied < length) {
+        size_t len;
+        uint8_t *data = (uint8_t *)xRingbufferReceiveUpTo(uart_rx_ringbuf, &len, ticks_to_wait, length - copied);
+        if (data == NULL) {
+            break;
+        }
+        memcpy(dst + copied, data, len);
+        vRingbufferReturnItem(uart_rx_ringbuf, data);
+        copied += len;
+
+        if (xTaskCheckForTimeOut(&time_out, &ticks_to_wait) == pdTRUE) {
+            break;
+        }
+    }
+    return copied;
+}
+
+int uart_write_bytes(uart_port_t uart_num, const void *src, size_t size)
+{
+    return write_all(uart_fd, src, size, portMAX_DELAY);
+}
+
+esp_err_t uart_wait_tx_done(uart_port_t uart_num, TickType_t ticks_to_wait)
+{
+    // writes go straight to the fd
+    return ESP_OK;
+}
+
+esp_err_t uart_set_sw_flow_ctrl(uart_port_t uart_num, bool enable, uint8_t rx_thresh_xon, uint8_t rx_thresh_xoff)
+{
+    return ESP_OK;
+}
+
+esp_err_t uart_set_hw_flow_ctrl(uart_port_t uart_num, uart_hw_flowcontrol_t flow_ctrl, uint8_t rx_thresh)
+{
+    return ESP_OK;
+}
+
+esp_err_t uart_get_buffered_data_len(uart_port_t uart_num, size_t *size)
+{
+    UBaseType_t waiting;
+    vRingbufferGetInfo(uart_rx_ringbuf, NULL, NULL, NULL, NULL, &waiting);
+    *size = waiting;
+    return ESP_OK;
+}
+
+esp_err_t uart_get_tx_buffer_free_size(uart_port_t uart_num, size_t *size)
+{
+    // writes go straight to the fd, there is no tx buffer to fill up
+    *size = 256;
+    return ESP_OK;
+}
+
+esp_err_t uart_flush_input(uart_port_t uart_num)
+{
+    size_t len;
+    void *data;
+    while ((data = xRingbufferReceiveUpTo(uart_rx_ringbuf, &len, 0, SIZE_MAX)) != NULL) {
+        vRingbufferReturnItem(uart_rx_ringbuf, data);
+    }
+    return ESP_OK;
+}
+
+
+/* USB serial */
+
+esp_err_t usb_serial_jtag_driver_install(usb_serial_jtag_driver_config_t *usb_serial_jtag_config)
+{
+    const char *path = getenv("FOCSTIM_USB");
+    if (path) {
+        usb_rx_fd = usb_tx_fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+        if (usb_rx_fd < 0) {
+            ESP_LOGE(TAG, "Unable to open usb endpoint: errno %d", errno);
+            return ESP_FAIL;
+        }
+    } else {
+        usb_rx_fd = STDIN_FILENO;
+        usb_tx_fd = STDOUT_FILENO;
+        fcntl(usb_rx_fd, F_SETFL, fcntl(usb_rx_fd, F_GETFL) | O_NONBLOCK);
+    }
+    return ESP_OK;
+}
+
+int usb_serial_jtag_read_bytes(void *buf, uint32_t length, TickType_t ticks_to_wait)
+{
+    if (!port_wait_readable(usb_rx_fd, ticks_to_wait)) {
+        return 0;
+    }
+    ssize_t len = read(usb_rx_fd, buf, length);
+    if (len <= 0) {
+        // end of input or host side not connected, behave like an idle port. Bounded, a
+        // caller waiting with portMAX_DELAY would otherwise never run again.
+        vTaskDelay(MIN(ticks_to_wait, pdMS_TO_TICKS(USB_EOF_POLL_MS)));
+        return 0;
+    }
+    return len;
+}
+
+int usb_serial_jtag_write_bytes(const void *src, size_t size, TickType_t ticks_to_wait)
+{
+    return write_all(usb_tx_fd, src, size, ticks_to_wait);
+}
@@ -0,0 +1,252 @@
+#include "power.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "sdkconfig.h"
+#include "esp_log.h"
+#if CONFIG_PM_ENABLE
+#include "esp_pm.h"
+#endif
+
+#include "port.h"
+#include "control.h"
+#include "latency.h"
+#include "tasks.h"
+
+#define STACK_SIZE              (3072)
+#define POWER_SAMPLE_MS         100
+// stay at a level at least this long after the traffic that raised it stopped.
+#define POWER_HOLD_MS           2000
+// telemetry from the stm32 above this rate counts as an active session, bytes per second.
+#define POWER_ACTIVE_RATE       2000
+// host -> stm32 latency above this raises the level, microseconds.
+#define POWER_LATENCY_TARGET_US 5000
+
+static const char *TAG = "power";
+
+static const char *level_names[POWER_NUM_LEVELS] = {
+    [POWER_IDLE] = "idle",
+    [POWER_STANDBY] = "standby",
+    [POWER_ACTIVE] = "active",
+};
+
+static TaskHandle_t governor_task_handle;
+#if CONFIG_PM_ENABLE
+static esp_pm_lock_handle_t cpu_lock;
+#endif
+
+static bool wifi_started = false;
+static int num_clients = 0;
+static size_t host_bytes = 0;
+static size_t stm_bytes = 0;
+// the cpu lock is held, taken by whichever task saw traffic first.
+// boost_lock keeps the flag and the lock in step between the mux and the governor.
+static bool boosted = false;
+static SemaphoreHandle_t boost_lock;
+// -1 lets the governor decide
+static volatile int pinned_level = -1;
+static volatile uint32_t active_rate = POWER_ACTIVE_RATE;
+static volatile uint32_t latency_target_us = POWER_LATENCY_TARGET_US;
+
+static power_level_t level = POWER_IDLE;
+static wifi_ps_type_t wifi_ps = WIFI_PS_MAX_MODEM;
+static uint32_t host_rate;
+static uint32_t stm_rate;
+static uint32_t latency_max_us;
+static uint32_t transitions[POWER_NUM_LEVELS];
+
+
+static void power_set_boost(bool boost)
+{
+    // cheap check first, the mux calls this for every chunk while not active
+    if (__atomic_load_n(&boosted, __ATOMIC_ACQUIRE) == boost) {
+        return;
+    }
+    xSemaphoreTake(boost_lock, portMAX_DELAY);
+    if (boosted != boost) {
+#if CONFIG_PM_ENABLE
+        if (boost) {
+            esp_pm_lock_acquire(cpu_lock);
+        } else {
+            esp_pm_lock_release(cpu_lock);
+        }
+#endif
+        __atomic_store_n(&boosted, boost, __ATOMIC_RELEASE);
+    }
+    xSemaphoreGive(boost_lock);
+}
+
+static void power_boost(void)
+{
+    power_set_boost(true);
+}
+
+static void power_unboost(void)
+{
+    power_set_boost(false);
+}
+
+void power_host_activity(size_t bytes)
+{
+    __atomic_fetch_add(&host_bytes, bytes, __ATOMIC_RELAXED);
+    if (level != POWER_ACTIVE && pinned_level < 0) {
+        // take the cpu lock here, the modem follows as soon as the governor runs.
+        power_boost();
+        xTaskNotifyGive(governor_task_handle);
+    }
+}
+
+void power_stm_activity(size_t bytes)
+{
+    __atomic_fetch_add(&stm_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+void power_client_connected(void)
+{
+    __atomic_fetch_add(&num_clients, 1, __ATOMIC_RELAXED);
+    if (governor_task_handle) {
+        xTaskNotifyGive(governor_task_handle);
+    }
+}
+
+void power_client_disconnected(void)
+{
+    __atomic_fetch_sub(&num_clients, 1, __ATOMIC_RELAXED);
+    if (governor_task_handle) {
+        xTaskNotifyGive(governor_task_handle);
+    }
+}
+
+void power_wifi_started(void)
+{
+    __atomic_store_n(&wifi_started, true, __ATOMIC_RELEASE);
+    xTaskNotifyGive(governor_task_handle);
+}
+
+static void power_apply(power_level_t new_level)
+{
+    if (new_level == POWER_ACTIVE) {
+        power_boost();
+    } else {
+        power_unboost();
+    }
+
+    // without clients there is no latency to protect on the radio, a busy USB session
+    // only needs the cpu.
+    wifi_ps_type_t ps = WIFI_PS_MAX_MODEM;
+    if (__atomic_load_n(&num_clients, __ATOMIC_RELAXED) > 0) {
+        ps = new_level == POWER_ACTIVE ? WIFI_PS_NONE : WIFI_PS_MIN_MODEM;
+    }
+    if (__atomic_load_n(&wifi_started, __ATOMIC_ACQUIRE) && ps != wifi_ps) {
+        esp_err_t err = esp_wifi_set_ps(ps);
+        if (err == ESP_OK) {
+            wifi_ps = ps;
+        } else {
+            ESP_LOGW(TAG, "esp_wifi_set_ps(%d) failed: %d", ps, err);
+        }
+    }
+
+    if (new_level != level) {
+        ESP_LOGI(TAG, "%s -> %s", level_names[level], level_names[new_level]);
+        transitions[new_level]++;
+        level = new_level;
+    }
+}
+
+static void governor_task(void *pvParameters)
+{
+    TickType_t last_sample = xTaskGetTickCount();
+    TickType_t last_busy = 0;
+    bool busy_seen = false;
+
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(POWER_SAMPLE_MS));
+
+        TickType_t now = xTaskGetTickCount();
+        uint32_t elapsed_ms = MAX(pdTICKS_TO_MS(now - last_sample), 1);
+        bool sampled = elapsed_ms >= POWER_SAMPLE_MS;
+
+        size_t host = __atomic_load_n(&host_bytes, __ATOMIC_RELAXED);
+        bool busy = host > 0;
+        if (sampled) {
+            host = __atomic_exchange_n(&host_bytes, 0, __ATOMIC_RELAXED);
+            size_t stm = __atomic_exchange_n(&stm_bytes, 0, __ATOMIC_RELAXED);
+            host_rate = host * 1000 / elapsed_ms;
+            stm_rate = stm * 1000 / elapsed_ms;
+            latency_max_us = MAX(latency_take_max(LATENCY_STM_TX), latency_take_max(LATENCY_STM_TX_URGENT));
+            last_sample = now;
+            busy = host > 0 || stm_rate >= active_rate || latency_max_us > latency_target_us;
+        }
+        if (busy) {
+            last_busy = now;
+            busy_seen = true;
+        }
+
+        power_level_t new_level;
+        if (pinned_level >= 0) {
+            new_level = pinned_level;
+        } else if (busy_seen && now - last_busy < pdMS_TO_TICKS(POWER_HOLD_MS)) {
+            new_level = POWER_ACTIVE;
+        } else if (__atomic_load_n(&num_clients, __ATOMIC_RELAXED) > 0) {
+            new_level = POWER_STANDBY;
+        } else {
+            new_level = POWER_IDLE;
+        }
+        power_apply(new_level);
+    }
+}
+
+static void power_command(int fd, int argc, char **argv)
+{
+    if (argc > 1) {
+        if (strcmp(argv[1], "auto") == 0) {
+            pinned_level = -1;
+        } else if (strcmp(argv[1], "rate") == 0 && argc > 2) {
+            active_rate = strtoul(argv[2], NULL, 0);
+        } else if (strcmp(argv[1], "latency") == 0 && argc > 2) {
+            latency_target_us = strtoul(argv[2], NULL, 0);
+        } else {
+            int i;
+            for (i = 0; i < POWER_NUM_LEVELS; i++) {
+                if (strcmp(argv[1], level_names[i]) == 0) {
+                    pinned_level = i;
+                    break;
+                }
+            }
+            if (i == POWER_NUM_LEVELS) {
+                control_printf(fd, "unknown level: %s\n", argv[1]);
+                return;
+            }
+        }
+        xTaskNotifyGive(governor_task_handle);
+    }
+
+    control_printf(fd, "level: %s (%s)\n", level_names[level], pinned_level < 0 ? "auto" : "pinned");
+    control_printf(fd, "wifi power save: %s\n",
+        wifi_ps == WIFI_PS_NONE ? "none" : wifi_ps == WIFI_PS_MIN_MODEM ? "min modem" : "max modem");
+    control_printf(fd, "cpu lock: %s\n", boosted ? "held" : "released");
+    control_printf(fd, "clients: %d\n", num_clients);
+    control_printf(fd, "host rate: %luB/s stm32 rate: %luB/s (active above %lu)\n",
+        (unsigned long)host_rate, (unsigned long)stm_rate, (unsigned long)active_rate);
+    control_printf(fd, "host -> stm32 latency max: %luus (target %lu)\n",
+        (unsigned long)latency_max_us, (unsigned long)latency_target_us);
+    control_printf(fd, "transitions: idle=%lu standby=%lu active=%lu\n",
+        (unsigned long)transitions[POWER_IDLE], (unsigned long)transitions[POWER_STANDBY],
+        (unsigned long)transitions[POWER_ACTIVE]);
+}
+
+void power_init(void)
+{
+#if CONFIG_PM_ENABLE
+    ESP_ERROR_CHECK(esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "power", &cpu_lock));
+#endif
+    boost_lock = xSemaphoreCreateMutex();
+    assert(boost_lock);
+    control_register("power", "[auto|idle|standby|active|rate <B/s>|latency <us>] power governor", power_command);
+
+    governor_task_handle = task_create(governor_task, "power", STACK_SIZE, NULL, 5);
+}
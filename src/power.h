@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stddef.h>
+
+// Traffic-adaptive power governor.
+//
+// Picks a power level from what the bridge is actually doing and applies it as a
+// CPU frequency lock and a WiFi power save mode:
+//
+//   POWER_IDLE      no network clients, no host traffic    DFS free, WIFI_PS_MAX_MODEM
+//   POWER_STANDBY   network client connected, but quiet    DFS free, WIFI_PS_MIN_MODEM
+//   POWER_ACTIVE    host commands, telemetry streaming     CPU at max, WIFI_PS_NONE (with clients)
+//                   or host -> stm32 latency over target
+//
+// Host commands raise the level right away from the task that forwards them, lower
+// levels only follow after POWER_HOLD_MS without traffic.
+// "power" on the control port shows the state and can pin a level.
+
+typedef enum {
+    POWER_IDLE,
+    POWER_STANDBY,
+    POWER_ACTIVE,
+    POWER_NUM_LEVELS,
+} power_level_t;
+
+void power_init(void);
+
+// WiFi is up, from now on the governor also controls the modem power save mode.
+void power_wifi_started(void);
+
+// a TCP client or UDP peer came or went.
+void power_client_connected(void);
+void power_client_disconnected(void);
+
+// bytes forwarded from a host to the stm32. Raises the level without waiting for the governor.
+void power_host_activity(size_t bytes);
+
+// bytes received from the stm32, only counts towards the telemetry rate.
+void power_stm_activity(size_t bytes);
@@ -0,0 +1,275 @@
+#include "schedule.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "port.h"
+#include "latency.h"
+#include "control.h"
+#include "timesync.h"
+#include "tasks.h"
+
+#define STACK_SIZE              (4096)
+#define MAX_DATAGRAM            (sizeof(schedule_frame_header_t) + SCHEDULE_MAX_LEN)
+// frames due further ahead than this are dropped, "schedule horizon <ms>" changes it.
+#define SCHEDULE_HORIZON_MS     1000
+
+static const char *TAG = "schedule";
+
+typedef struct {
+    bool used;
+    int64_t due;
+    uint32_t seq;           // frames due at the same time go out in order of arrival
+    uint16_t len;
+    uint8_t data[SCHEDULE_MAX_LEN];
+} schedule_entry_t;
+
+typedef struct {
+    uint32_t frames;
+    uint32_t timed;         // within the horizon, margin statistics are over these
+    uint32_t late;          // arrived after they were due, sent at once
+    uint32_t too_far;       // due beyond the horizon, dropped
+    uint32_t too_old;       // due more than the horizon ago, an unsynced clock, dropped
+    uint32_t full;          // table full, dropped
+    uint32_t oversize;
+    uint32_t overflows;     // output buffer full at release, dropped
+    int32_t margin_min_us;  // due - arrival, how much of the buffer a frame didn't need
+    int32_t margin_max_us;
+    uint32_t jitter_us;     // RFC 3550 style, of the margin
+    int queued_max;
+} schedule_stats_t;
+
+static fanout_t *out_buffer;
+static esp_timer_handle_t timer;
+// held for the table and to arm the timer, by the server task and the timer callback
+static SemaphoreHandle_t lock;
+static schedule_entry_t entries[SCHEDULE_MAX_FRAMES];
+static int queued = 0;
+static uint32_t next_seq = 0;
+
+// added to every due time, the depth of the jitter buffer on top of what the client chose
+static volatile int32_t delay_us = 0;
+static volatile uint32_t horizon_ms = SCHEDULE_HORIZON_MS;
+static int32_t last_margin;
+static schedule_stats_t stats;
+
+
+// index of the frame due first, or -1. Call with the lock held.
+static int schedule_earliest(void)
+{
+    int earliest = -1;
+    for (int i = 0; i < SCHEDULE_MAX_FRAMES; i++) {
+        if (!entries[i].used) {
+            continue;
+        }
+        if (earliest < 0 || entries[i].due < entries[earliest].due
+                || (entries[i].due == entries[earliest].due
+                    && (int32_t)(entries[i].seq - entries[earliest].seq) < 0)) {
+            earliest = i;
+        }
+    }
+    return earliest;
+}
+
+// (re)arm the timer for the frame due first. Call with the lock held.
+static void schedule_arm(int64_t now)
+{
+    int earliest = schedule_earliest();
+    esp_timer_stop(timer);
+    if (earliest >= 0) {
+        int64_t wait = entries[earliest].due - now;
+        esp_timer_start_once(timer, wait > 0 ? wait : 0);
+    }
+}
+
+// the timer callback, writes every frame that is due to the output buffer.
+static void schedule_release(void *arg)
+{
+    static uint8_t frame[SCHEDULE_MAX_LEN];
+
+    while (1) {
+        xSemaphoreTake(lock, portMAX_DELAY);
+        int64_t now = esp_timer_get_time();
+        int earliest = schedule_earliest();
+        if (earliest < 0 || entries[earliest].due > now) {
+            schedule_arm(now);
+            xSemaphoreGive(lock);
+            return;
+        }
+        schedule_entry_t *entry = &entries[earliest];
+        size_t len = entry->len;
+        uint32_t error = now - entry->due;
+        memcpy(frame, entry->data, len);
+        entry->used = false;
+        queued--;
+        xSemaphoreGive(lock);
+
+        // timestamped at release, the time in the buffer is on purpose.
+        if (fanout_free(out_buffer) < len) {
+            stats.overflows++;
+            continue;
+        }
+        fanout_write(out_buffer, frame, len, latency_now(), 0);
+        latency_record(LATENCY_SCHEDULE, error);
+    }
+}
+
+static void schedule_add(const uint8_t *data, size_t len, int64_t due, int64_t arrival)
+{
+    stats.frames++;
+    if (len > SCHEDULE_MAX_LEN) {
+        stats.oversize++;
+        return;
+    }
+    due += delay_us;
+    int64_t horizon_us = (int64_t)horizon_ms * 1000;
+    if (due - arrival > horizon_us) {
+        stats.too_far++;
+        return;
+    }
+    if (arrival - due > horizon_us) {
+        stats.too_old++;
+        return;
+    }
+
+    // within +-horizon, fits
+    int32_t margin = due - arrival;
+    stats.timed++;
+    if (stats.timed == 1 || margin < stats.margin_min_us) {
+        stats.margin_min_us = margin;
+    }
+    if (stats.timed == 1 || margin > stats.margin_max_us) {
+        stats.margin_max_us = margin;
+    }
+    int32_t d = margin - last_margin;
+    // J += (|D| - J) / 16
+    stats.jitter_us += ((d < 0 ? -d : d) - (int32_t)stats.jitter_us) / 16;
+    last_margin = margin;
+
+    if (margin < 0) {
+        stats.late++;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    int slot = -1;
+    for (int i = 0; i < SCHEDULE_MAX_FRAMES; i++) {
+        if (!entries[i].used) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot < 0) {
+        stats.full++;
+    } else {
+        schedule_entry_t *entry = &entries[slot];
+        entry->used = true;
+        entry->due = due;
+        entry->seq = next_seq++;
+        entry->len = len;
+        memcpy(entry->data, data, len);
+        queued++;
+        if (queued > stats.queued_max) {
+            stats.queued_max = queued;
+        }
+        if (schedule_earliest() == slot) {
+            schedule_arm(arrival);
+        }
+    }
+    xSemaphoreGive(lock);
+}
+
+static void schedule_receive(int sock)
+{
+    // one more byte than a frame may have, so longer datagrams are recognized
+    static uint8_t datagram[MAX_DATAGRAM + 1];
+    struct sockaddr_in source_addr;
+    socklen_t addr_len = sizeof(source_addr);
+
+    int len = recvfrom(sock, datagram, sizeof(datagram), 0, (struct sockaddr *)&source_addr, &addr_len);
+    int64_t arrival = esp_timer_get_time();
+    if (len < 1) {
+        return;
+    }
+
+    timesync_msg_t sync;
+    if (timesync_reply(datagram, len, arrival, &sync)) {
+        sendto(sock, &sync, sizeof(sync), 0, (struct sockaddr *)&source_addr, addr_len);
+    } else if (datagram[0] == SCHEDULE_MSG_FRAME && len > (int)sizeof(schedule_frame_header_t)) {
+        schedule_frame_header_t header;
+        memcpy(&header, datagram, sizeof(header));
+        schedule_add(datagram + sizeof(header), len - sizeof(header), header.due, arrival);
+    }
+}
+
+static void schedule_task(void *pvParameters)
+{
+    struct sockaddr_in dest_addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(SCHEDULE_PORT),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    if (sock < 0) {
+        ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
+        vTaskDelete(NULL);
+        return;
+    }
+    if (bind(sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) != 0) {
+        ESP_LOGE(TAG, "Socket unable to bind: errno %d", errno);
+        close(sock);
+        vTaskDelete(NULL);
+        return;
+    }
+
+    while (1) {
+        port_wait_readable(sock, portMAX_DELAY);
+        schedule_receive(sock);
+    }
+}
+
+static void schedule_command(int fd, int argc, char **argv)
+{
+    if (argc >= 3 && strcmp(argv[1], "delay") == 0) {
+        delay_us = strtol(argv[2], NULL, 10);
+    } else if (argc >= 3 && strcmp(argv[1], "horizon") == 0) {
+        unsigned long ms = strtoul(argv[2], NULL, 10);
+        // the margin to the due time is kept in an int32 of microseconds
+        horizon_ms = ms > INT32_MAX / 1000 ? INT32_MAX / 1000 : ms;
+    } else if (argc >= 2 && strcmp(argv[1], "reset") == 0) {
+        memset(&stats, 0, sizeof(stats));
+    }
+
+    control_printf(fd, "delay: %ldus, horizon: %lums\n", (long)delay_us, (unsigned long)horizon_ms);
+    control_printf(fd, "queued: %d/%d max=%d\n", queued, SCHEDULE_MAX_FRAMES, stats.queued_max);
+    control_printf(fd, "frames=%lu late=%lu too_far=%lu too_old=%lu full=%lu oversize=%lu overflows=%lu\n",
+        (unsigned long)stats.frames, (unsigned long)stats.late,
+        (unsigned long)stats.too_far, (unsigned long)stats.too_old, (unsigned long)stats.full, (unsigned long)stats.oversize,
+        (unsigned long)stats.overflows);
+    control_printf(fd, "margin: min=%ldus max=%ldus jitter=%luus\n",
+        (long)stats.margin_min_us, (long)stats.margin_max_us, (unsigned long)stats.jitter_us);
+}
+
+void create_schedule_task(fanout_t *out)
+{
+    out_buffer = out;
+    lock = xSemaphoreCreateMutex();
+    assert(lock);
+
+    esp_timer_create_args_t args = {
+        .callback = schedule_release,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "schedule",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&args, &timer));
+
+    control_register("schedule", "[delay <us>|horizon <ms>|reset] timed command jitter buffer", schedule_command);
+
+    task_create(schedule_task, "schedule", STACK_SIZE, NULL, 5);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+#include "fanout.h"
+
+// Timed commands: a jitter buffer that releases host frames to the stm32 at a target time,
+// so WiFi delivery jitter doesn't reach the stm32 when stimulation follows media playback.
+//
+// Clients talk to UDP port SCHEDULE_PORT. Every datagram starts with a type byte:
+//
+//   SYNC: clock sync request, see timesync.h.
+//   FRAME: header with the device time the payload is due, followed by whole stm32 frames.
+//
+// Frames wait in a small table until they are due, an esp_timer releases them into the
+// output buffer, which is a mux source of its own. Frames that arrive late go out at once,
+// frames too far ahead are dropped. All times are little endian microseconds.
+
+#define SCHEDULE_PORT           55535
+#define SCHEDULE_MAX_FRAMES     32
+#define SCHEDULE_MAX_LEN        128
+
+#define SCHEDULE_MSG_FRAME      'F'
+
+typedef struct __attribute__((packed)) {
+    uint8_t type;           // SCHEDULE_MSG_FRAME
+    uint8_t reserved[3];
+    uint64_t due;           // device clock
+} schedule_frame_header_t;
+
+// Released frames go to `out`, registered as mux source "sched".
+void create_schedule_task(fanout_t *out);
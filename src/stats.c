@@ -0,0 +1,153 @@
+#include "stats.h"
+
+#include <string.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+
+#include "port.h"
+#include "control.h"
+#include "fanout.h"
+#include "tasks.h"
+#include "uart.h"
+
+#define STACK_SIZE  (3072)
+
+typedef struct {
+    uint8_t data[STATS_PAGE_SIZE];
+    size_t len;
+} stats_page_buffer_t;
+
+// the snapshot task fills one set while the other is read
+static stats_page_buffer_t snapshots[2][STATS_NUM_PAGES];
+static volatile int published = 0;
+
+
+static void put_u16(stats_page_buffer_t *page, uint16_t value)
+{
+    if (page->len + 2 <= STATS_PAGE_SIZE) {
+        page->data[page->len++] = value & 0xff;
+        page->data[page->len++] = value >> 8;
+    }
+}
+
+static void put_u32(stats_page_buffer_t *page, uint32_t value)
+{
+    if (page->len + 4 <= STATS_PAGE_SIZE) {
+        for (int i = 0; i < 4; i++) {
+            page->data[page->len++] = (value >> (8 * i)) & 0xff;
+        }
+    }
+}
+
+static void build_system_page(stats_page_buffer_t *page)
+{
+    uart_stats_t uart;
+    uart_get_stats(&uart);
+
+    page->len = 0;
+    put_u32(page, esp_timer_get_time() / 1000);
+    put_u32(page, esp_get_free_heap_size());
+    put_u32(page, esp_get_minimum_free_heap_size());
+    put_u32(page, uart.baud_rate);
+    put_u32(page, uart.fifo_overflows);
+    put_u32(page, uart.buffer_full);
+    put_u32(page, uart.parity_errors);
+    put_u32(page, uart.frame_errors);
+    put_u32(page, uart.fallbacks);
+    put_u32(page, uart.tx_bytes);
+    put_u32(page, uart.tx_stall_gaps);
+}
+
+static void build_buffers_page(stats_page_buffer_t *page)
+{
+    int count = MIN(fanout_num_buffers(), (STATS_PAGE_SIZE - 1) / 16);
+    page->len = 0;
+    page->data[page->len++] = count;
+    for (int i = 0; i < count; i++) {
+        fanout_stats_t stats;
+        fanout_get_stats(i, &stats);
+        put_u16(page, MIN(stats.size, UINT16_MAX));
+        put_u16(page, MIN(stats.high_water, UINT16_MAX));
+        put_u32(page, stats.bytes);
+        put_u32(page, stats.chunks);
+        put_u32(page, stats.dropped);
+    }
+}
+
+static void build_tasks_page(stats_page_buffer_t *page)
+{
+    int count = MIN(task_count(), (STATS_PAGE_SIZE - 1) / 10);
+    page->len = 0;
+    page->data[page->len++] = count;
+    for (int i = 0; i < count; i++) {
+        task_stats_t stats;
+        task_get_stats(i, &stats);
+        memset(page->data + page->len, 0, 8);
+        strncpy((char *)page->data + page->len, stats.name, 8);
+        page->len += 8;
+        put_u16(page, MIN(stats.stack_free_min, UINT16_MAX));
+    }
+}
+
+static void stats_task(void *pvParameters)
+{
+    while (1) {
+        int next = !published;
+        build_system_page(&snapshots[next][STATS_PAGE_SYSTEM]);
+        build_buffers_page(&snapshots[next][STATS_PAGE_BUFFERS]);
+        build_tasks_page(&snapshots[next][STATS_PAGE_TASKS]);
+        published = next;
+
+        vTaskDelay(pdMS_TO_TICKS(STATS_INTERVAL_MS));
+    }
+}
+
+size_t stats_read_page(int page, uint8_t *dst, size_t max_len)
+{
+    if (page < 0 || page >= STATS_NUM_PAGES) {
+        return 0;
+    }
+    const stats_page_buffer_t *buffer = &snapshots[published][page];
+    size_t len = MIN(buffer->len, max_len);
+    memcpy(dst, buffer->data, len);
+    return len;
+}
+
+static void stats_command(int fd, int argc, char **argv)
+{
+    control_printf(fd, "uptime: %llums\n", (unsigned long long)(esp_timer_get_time() / 1000));
+    control_printf(fd, "heap: free=%lu min=%lu\n",
+        (unsigned long)esp_get_free_heap_size(), (unsigned long)esp_get_minimum_free_heap_size());
+
+    uart_stats_t uart;
+    uart_get_stats(&uart);
+    control_printf(fd, "uart: baud=%lu fifo_overflows=%lu buffer_full=%lu parity=%lu frame=%lu fallbacks=%lu\n",
+        (unsigned long)uart.baud_rate, (unsigned long)uart.fifo_overflows, (unsigned long)uart.buffer_full,
+        (unsigned long)uart.parity_errors, (unsigned long)uart.frame_errors, (unsigned long)uart.fallbacks);
+    control_printf(fd, "uart tx: bytes=%lu stalls=%lu\n", (unsigned long)uart.tx_bytes, (unsigned long)uart.tx_stall_gaps);
+
+    for (int i = 0; i < fanout_num_buffers(); i++) {
+        fanout_stats_t stats;
+        fanout_get_stats(i, &stats);
+        control_printf(fd, "buffer %s: size=%lu used=%lu high=%lu bytes=%lu chunks=%lu dropped=%lu\n",
+            stats.name, (unsigned long)stats.size, (unsigned long)stats.used, (unsigned long)stats.high_water,
+            (unsigned long)stats.bytes, (unsigned long)stats.chunks, (unsigned long)stats.dropped);
+    }
+
+    for (int i = 0; i < task_count(); i++) {
+        task_stats_t stats;
+        task_get_stats(i, &stats);
+        control_printf(fd, "task %s: core=%d priority=%lu stack=%lu stack_free_min=%lu\n",
+            stats.name, stats.core, (unsigned long)stats.priority,
+            (unsigned long)stats.stack_size, (unsigned long)stats.stack_free_min);
+    }
+}
+
+void stats_init(void)
+{
+    control_register("stats", "counters, buffer high-water marks and task stack watermarks", stats_command);
+
+    task_create(stats_task, "stats", STACK_SIZE, NULL, 1);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Bridge statistics, for sizing buffers and stacks from real data.
+//
+// "stats" on the control port prints everything as text. The stm32 reads the same
+// numbers over I2C (ESP32_COMMAND_STATS <page>) as a binary snapshot, rebuilt once
+// per STATS_INTERVAL_MS by a background task so the I2C callback only copies bytes.
+//
+// Pages, all values little endian:
+//   STATS_PAGE_SYSTEM   u32 uptime_ms, u32 free_heap, u32 min_free_heap,
+//                       u32 uart baud_rate, fifo_overflows, buffer_full, parity_errors,
+//                       frame_errors, fallbacks, tx_bytes, tx_stall_gaps
+//   STATS_PAGE_BUFFERS  u8 count, then per buffer: u16 size, u16 high_water,
+//                       u32 bytes, u32 chunks, u32 dropped
+//   STATS_PAGE_TASKS    u8 count, then per task: char name[8] (zero padded), u16 stack_free_min
+typedef enum {
+    STATS_PAGE_SYSTEM,
+    STATS_PAGE_BUFFERS,
+    STATS_PAGE_TASKS,
+    STATS_NUM_PAGES,
+} stats_page_t;
+
+#define STATS_PAGE_SIZE     255
+#define STATS_INTERVAL_MS   1000
+
+// registers the "stats" control command and starts the snapshot task.
+void stats_init(void);
+
+// Copy the latest snapshot of a page, returns its length. Safe to call from an ISR.
+size_t stats_read_page(int page, uint8_t *dst, size_t max_len);
@@ -0,0 +1,444 @@
+#include "stm32_flash.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+
+#include "port.h"
+#include "uart.h"
+#include "control.h"
+#include "tasks.h"
+
+#define STACK_SIZE              (4096)
+#define STM32_PARTITION_SUBTYPE 0x40
+// the header goes into the first sector, the image follows. The header is written last,
+// so an interrupted upload leaves no image behind.
+#define IMAGE_OFFSET            0x1000
+#define SECTOR_SIZE             0x1000
+#define BLOCK_SIZE              256
+// the bootloader detects the baud rate from the sync byte, "stm32 baud <rate>" changes it.
+#define BOOTLOADER_BAUD_RATE    115200
+#define SYNC_TIMEOUT_MS         5000
+#define SYNC_INTERVAL_MS        100
+#define ACK_TIMEOUT_MS          1000
+#define ERASE_TIMEOUT_MS        30000
+#define UPLOAD_TIMEOUT_MS       5000
+
+// AN3155
+#define BL_SYNC                 0x7F
+#define BL_ACK                  0x79
+#define BL_NACK                 0x1F
+#define BL_CMD_GET              0x00
+#define BL_CMD_READ             0x11
+#define BL_CMD_GO               0x21
+#define BL_CMD_WRITE            0x31
+#define BL_CMD_ERASE            0x43
+#define BL_CMD_EXT_ERASE        0x44
+
+static const char *TAG = "stm32_flash";
+
+static const esp_partition_t *partition;
+// one flash at a time, from an upload or the control port
+static SemaphoreHandle_t flash_lock;
+static volatile uint32_t bootloader_baud_rate = BOOTLOADER_BAUD_RATE;
+
+// progress, for the "stm32" command
+static const char *volatile status = "idle";
+static volatile uint32_t progress_done;
+static volatile uint32_t progress_total;
+
+
+static bool bl_wait_ack(TickType_t timeout)
+{
+    uint8_t reply;
+    return uart_raw_read(&reply, 1, timeout) == 1 && reply == BL_ACK;
+}
+
+static bool bl_command(uint8_t command)
+{
+    uint8_t msg[2] = {command, command ^ 0xFF};
+    uart_raw_write(msg, sizeof(msg));
+    return bl_wait_ack(pdMS_TO_TICKS(ACK_TIMEOUT_MS));
+}
+
+static bool bl_address(uint32_t address)
+{
+    uint8_t msg[5] = {address >> 24, address >> 16, address >> 8, address};
+    msg[4] = msg[0] ^ msg[1] ^ msg[2] ^ msg[3];
+    uart_raw_write(msg, sizeof(msg));
+    return bl_wait_ack(pdMS_TO_TICKS(ACK_TIMEOUT_MS));
+}
+
+static bool bl_sync(void)
+{
+    TickType_t start = xTaskGetTickCount();
+    while (xTaskGetTickCount() - start < pdMS_TO_TICKS(SYNC_TIMEOUT_MS)) {
+        uint8_t sync = BL_SYNC;
+        uart_raw_write(&sync, 1);
+        uint8_t reply;
+        // a NACK means the bootloader was synced already and took this for a command
+        if (uart_raw_read(&reply, 1, pdMS_TO_TICKS(SYNC_INTERVAL_MS)) == 1
+                && (reply == BL_ACK || reply == BL_NACK)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// which erase command the bootloader supports, 0 if none
+static uint8_t bl_get_erase_command(void)
+{
+    if (!bl_command(BL_CMD_GET)) {
+        return 0;
+    }
+    uint8_t reply[32];
+    uint8_t count;
+    if (uart_raw_read(&count, 1, pdMS_TO_TICKS(ACK_TIMEOUT_MS)) != 1 || count + 1 > sizeof(reply)) {
+        return 0;
+    }
+    // version and count commands, then an ACK
+    if (uart_raw_read(reply, count + 1, pdMS_TO_TICKS(ACK_TIMEOUT_MS)) != count + 1
+            || !bl_wait_ack(pdMS_TO_TICKS(ACK_TIMEOUT_MS))) {
+        return 0;
+    }
+    uint8_t erase = 0;
+    for (int i = 1; i <= count; i++) {
+        if (reply[i] == BL_CMD_EXT_ERASE || (reply[i] == BL_CMD_ERASE && erase == 0)) {
+            erase = reply[i];
+        }
+    }
+    return erase;
+}
+
+static bool bl_mass_erase(uint8_t erase)
+{
+    if (!bl_command(erase)) {
+        return false;
+    }
+    if (erase == BL_CMD_EXT_ERASE) {
+        uint8_t msg[3] = {0xFF, 0xFF, 0x00};
+        uart_raw_write(msg, sizeof(msg));
+    } else {
+        uint8_t msg[2] = {0xFF, 0x00};
+        uart_raw_write(msg, sizeof(msg));
+    }
+    return bl_wait_ack(pdMS_TO_TICKS(ERASE_TIMEOUT_MS));
+}
+
+// length and data of a write, plus checksum
+typedef struct {
+    uint8_t buf[1 + BLOCK_SIZE + 1];
+    size_t len;
+} bl_block_t;
+
+static bool bl_block_load(bl_block_t *block, size_t offset, size_t len)
+{
+    // writes must be a multiple of 4 bytes, pad with erased flash
+    size_t padded = (len + 3) & ~3;
+    block->buf[0] = padded - 1;
+    if (esp_partition_read(partition, IMAGE_OFFSET + offset, block->buf + 1, len) != ESP_OK) {
+        return false;
+    }
+    memset(block->buf + 1 + len, 0xFF, padded - len);
+    uint8_t checksum = 0;
+    for (int i = 0; i < 1 + padded; i++) {
+        checksum ^= block->buf[i];
+    }
+    block->buf[1 + padded] = checksum;
+    block->len = padded + 2;
+    return true;
+}
+
+static const char *bl_write_image(const stm32_flash_header_t *header, int fd)
+{
+    static bl_block_t blocks[2];
+    int current = 0;
+    if (!bl_block_load(&blocks[current], 0, MIN(header->size, BLOCK_SIZE))) {
+        return "partition read failed";
+    }
+
+    uint32_t reported = 0;
+    for (size_t offset = 0; offset < header->size; offset += BLOCK_SIZE) {
+        if (!bl_command(BL_CMD_WRITE) || !bl_address(header->address + offset)) {
+            return "write command not acknowledged";
+        }
+        uart_raw_write(blocks[current].buf, blocks[current].len);
+
+        // prepare the next block while the stm32 programs this one
+        size_t next = offset + BLOCK_SIZE;
+        if (next < header->size && !bl_block_load(&blocks[current ^ 1], next, MIN(header->size - next, BLOCK_SIZE))) {
+            return "partition read failed";
+        }
+        if (!bl_wait_ack(pdMS_TO_TICKS(ACK_TIMEOUT_MS))) {
+            return "write not acknowledged";
+        }
+        current ^= 1;
+
+        progress_done = MIN(next, header->size);
+        if (progress_done * 10 / header->size != reported) {
+            reported = progress_done * 10 / header->size;
+            control_printf(fd, "write %lu/%lu\n", (unsigned long)progress_done, (unsigned long)header->size);
+        }
+    }
+    return NULL;
+}
+
+static const char *bl_verify_image(const stm32_flash_header_t *header, int fd)
+{
+    static uint8_t expected[BLOCK_SIZE];
+    static uint8_t actual[BLOCK_SIZE];
+
+    for (size_t offset = 0; offset < header->size; offset += BLOCK_SIZE) {
+        size_t len = MIN(header->size - offset, BLOCK_SIZE);
+        if (!bl_command(BL_CMD_READ) || !bl_address(header->address + offset)) {
+            return "read command not acknowledged";
+        }
+        uint8_t count[2] = {len - 1, (len - 1) ^ 0xFF};
+        uart_raw_write(count, sizeof(count));
+        if (!bl_wait_ack(pdMS_TO_TICKS(ACK_TIMEOUT_MS))
+                || uart_raw_read(actual, len, pdMS_TO_TICKS(ACK_TIMEOUT_MS)) != len) {
+            return "read failed";
+        }
+        if (esp_partition_read(partition, IMAGE_OFFSET + offset, expected, len) != ESP_OK) {
+            return "partition read failed";
+        }
+        if (memcmp(expected, actual, len) != 0) {
+            control_printf(fd, "mismatch at 0x%08lx\n", (unsigned long)(header->address + offset));
+            return "verify failed";
+        }
+        progress_done = offset + len;
+    }
+    return NULL;
+}
+
+// erase, write, verify and start the stored image, reporting to `fd`. Called with flash_lock held.
+static bool stm32_flash_image(int fd)
+{
+    stm32_flash_header_t header;
+    if (partition == NULL || esp_partition_read(partition, 0, &header, sizeof(header)) != ESP_OK
+            || memcmp(header.magic, STM32_FLASH_MAGIC, 4) != 0) {
+        control_printf(fd, "error: no image stored\n");
+        return false;
+    }
+
+    const char *error = NULL;
+    progress_done = 0;
+    progress_total = header.size;
+    uart_raw_begin(bootloader_baud_rate);
+
+    status = "sync";
+    control_printf(fd, "waiting for the stm32 bootloader\n");
+    uint8_t erase = 0;
+    if (!bl_sync()) {
+        error = "no bootloader";
+    } else if ((erase = bl_get_erase_command()) == 0) {
+        error = "no erase command";
+    }
+    if (!error) {
+        status = "erase";
+        control_printf(fd, "erase\n");
+        if (!bl_mass_erase(erase)) {
+            error = "erase failed";
+        }
+    }
+    if (!error) {
+        status = "write";
+        error = bl_write_image(&header, fd);
+    }
+    if (!error) {
+        status = "verify";
+        control_printf(fd, "verify\n");
+        error = bl_verify_image(&header, fd);
+    }
+    if (!error) {
+        status = "start";
+        if (!bl_command(BL_CMD_GO) || !bl_address(header.address)) {
+            error = "go not acknowledged";
+        }
+    }
+
+    uart_raw_end();
+    status = error ? error : "ok";
+
+    if (error) {
+        ESP_LOGE(TAG, "%s", error);
+        control_printf(fd, "error: %s\n", error);
+        return false;
+    }
+    control_printf(fd, "ok\n");
+    return true;
+}
+
+static bool stm32_flash_stored(int fd)
+{
+    if (xSemaphoreTake(flash_lock, 0) != pdTRUE) {
+        control_printf(fd, "error: busy\n");
+        return false;
+    }
+    bool ok = stm32_flash_image(fd);
+    xSemaphoreGive(flash_lock);
+    return ok;
+}
+
+static bool recv_all(int sock, void *data, size_t len)
+{
+    uint8_t *dst = data;
+    while (len > 0) {
+        if (!port_wait_readable(sock, pdMS_TO_TICKS(UPLOAD_TIMEOUT_MS))) {
+            return false;
+        }
+        int n = recv(sock, dst, len, 0);
+        if (n <= 0) {
+            return false;
+        }
+        dst += n;
+        len -= n;
+    }
+    return true;
+}
+
+// store an uploaded image in the partition, then flash it. Called with flash_lock held,
+// so a flash from the control port never reads a partition that is being rewritten.
+static void stm32_flash_receive(int sock)
+{
+    static uint8_t buf[1024];
+    stm32_flash_header_t header;
+    if (!recv_all(sock, &header, sizeof(header)) || memcmp(header.magic, STM32_FLASH_MAGIC, 4) != 0) {
+        control_printf(sock, "error: bad header\n");
+        return;
+    }
+    if (partition == NULL || header.size == 0 || header.size > partition->size - IMAGE_OFFSET) {
+        control_printf(sock, "error: image size\n");
+        return;
+    }
+
+    status = "upload";
+    progress_done = 0;
+    progress_total = header.size;
+    size_t end = (IMAGE_OFFSET + header.size + SECTOR_SIZE - 1) & ~(SECTOR_SIZE - 1);
+    if (esp_partition_erase_range(partition, 0, end) != ESP_OK) {
+        control_printf(sock, "error: partition erase failed\n");
+        status = "idle";
+        return;
+    }
+    uint32_t crc = 0;
+    for (size_t offset = 0; offset < header.size;) {
+        size_t len = MIN(sizeof(buf), header.size - offset);
+        if (!recv_all(sock, buf, len)
+                || esp_partition_write(partition, IMAGE_OFFSET + offset, buf, len) != ESP_OK) {
+            control_printf(sock, "error: upload failed\n");
+            status = "idle";
+            return;
+        }
+        crc = esp_rom_crc32_le(crc, buf, len);
+        offset += len;
+        progress_done = offset;
+    }
+    if (crc != header.crc32) {
+        control_printf(sock, "error: crc mismatch\n");
+        status = "idle";
+        return;
+    }
+    if (esp_partition_write(partition, 0, &header, sizeof(header)) != ESP_OK) {
+        control_printf(sock, "error: header write failed\n");
+        status = "idle";
+        return;
+    }
+    control_printf(sock, "received %lu bytes\n", (unsigned long)header.size);
+
+    stm32_flash_image(sock);
+}
+
+static void stm32_flash_upload(int sock)
+{
+    if (xSemaphoreTake(flash_lock, 0) != pdTRUE) {
+        control_printf(sock, "error: busy\n");
+        return;
+    }
+    stm32_flash_receive(sock);
+    xSemaphoreGive(flash_lock);
+}
+
+static void stm32_flash_task(void *pvParameters)
+{
+    struct sockaddr_in dest_addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(STM32_FLASH_PORT),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+
+    int listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    if (listen_sock < 0) {
+        ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
+        vTaskDelete(NULL);
+        return;
+    }
+    int opt = 1;
+    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    if (bind(listen_sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) != 0
+            || listen(listen_sock, 1) != 0) {
+        ESP_LOGE(TAG, "Unable to listen on port %d: errno %d", STM32_FLASH_PORT, errno);
+        close(listen_sock);
+        vTaskDelete(NULL);
+        return;
+    }
+
+    while (1) {
+        port_wait_readable(listen_sock, portMAX_DELAY);
+        int sock = accept(listen_sock, NULL, NULL);
+        if (sock < 0) {
+            ESP_LOGE(TAG, "Unable to accept connection: errno %d", errno);
+            continue;
+        }
+        // an upload that stalls doesn't hold the port forever
+        struct timeval timeout = {.tv_sec = UPLOAD_TIMEOUT_MS / 1000};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        stm32_flash_upload(sock);
+        shutdown(sock, 0);
+        close(sock);
+    }
+}
+
+static void stm32_command(int fd, int argc, char **argv)
+{
+    if (argc >= 2 && strcmp(argv[1], "flash") == 0) {
+        // runs right here, progress goes to the control connection
+        stm32_flash_stored(fd);
+        return;
+    } else if (argc >= 3 && strcmp(argv[1], "baud") == 0) {
+        bootloader_baud_rate = strtoul(argv[2], NULL, 10);
+    }
+
+    stm32_flash_header_t header;
+    if (partition && esp_partition_read(partition, 0, &header, sizeof(header)) == ESP_OK
+            && memcmp(header.magic, STM32_FLASH_MAGIC, 4) == 0) {
+        control_printf(fd, "image: %lu bytes at 0x%08lx crc 0x%08lx\n", (unsigned long)header.size,
+            (unsigned long)header.address, (unsigned long)header.crc32);
+    } else {
+        control_printf(fd, "image: none\n");
+    }
+    control_printf(fd, "bootloader baud: %lu\n", (unsigned long)bootloader_baud_rate);
+    control_printf(fd, "status: %s %lu/%lu\n", status, (unsigned long)progress_done, (unsigned long)progress_total);
+}
+
+void create_stm32_flash_task(void)
+{
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, STM32_PARTITION_SUBTYPE, "stm32");
+    if (partition == NULL) {
+        ESP_LOGE(TAG, "no stm32 partition");
+    }
+    flash_lock = xSemaphoreCreateMutex();
+    assert(flash_lock);
+
+    control_register("stm32", "[flash|baud <rate>] stored stm32 image, flash it through the bootloader", stm32_command);
+
+    task_create(stm32_flash_task, "stm32 flash", STACK_SIZE, NULL, 5);
+}
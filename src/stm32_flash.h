@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+
+// Flashes the stm32 through its ROM bootloader (ST AN3155) over the bridge uart, from an
+// image kept in the "stm32" data partition, instead of the host driving the bootloader
+// through the bridge and paying a WiFi round trip for every ACK.
+//
+// Upload: connect to TCP port STM32_FLASH_PORT and send a stm32_flash_header_t followed
+// by the image. Once the image is stored and its CRC checks out, the esp32 erases, writes
+// and verifies the stm32 and starts the new firmware. Progress is reported as text lines
+// on the same connection, the last one is "ok" or "error: <reason>".
+// "stm32 flash" on the control port flashes the stored image again.
+//
+// The stm32 must be in its bootloader: started with BOOT0 high, or jumped to by the
+// application on a host command. The esp32 keeps sending the sync byte for a few seconds.
+
+#define STM32_FLASH_PORT        55536
+#define STM32_FLASH_MAGIC       "FOCF"
+#define STM32_FLASH_BASE        0x08000000
+
+typedef struct __attribute__((packed)) {
+    char magic[4];          // STM32_FLASH_MAGIC
+    uint32_t address;       // where the image goes, usually STM32_FLASH_BASE
+    uint32_t size;
+    uint32_t crc32;         // of the image, as esp_rom_crc32_le(0, ...) / zlib crc32
+} stm32_flash_header_t;
+
+void create_stm32_flash_task(void);
@@ -0,0 +1,135 @@
+#include "tasks.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include "esp_log.h"
+
+#include "control.h"
+
+static const char *TAG = "tasks";
+
+typedef struct {
+    const char *name;
+    int core;
+    UBaseType_t priority;
+} task_placement_t;
+
+// Bridge I/O above everything else on its core, the network side keeps its priorities
+// relative to the WiFi (23) and lwIP (18) tasks on core 0.
+static const task_placement_t placements[] = {
+    {"uart rx task", TASK_CORE_BRIDGE,  12},
+    {"uart tx task", TASK_CORE_BRIDGE,  12},
+    {"uart link",    TASK_CORE_BRIDGE,  5},
+    {"USB rx",       TASK_CORE_BRIDGE,  11},
+    {"USB tx",       TASK_CORE_BRIDGE,  11},
+    {"mux",          TASK_CORE_BRIDGE,  11},
+    {"bridge",       TASK_CORE_BRIDGE,  12},
+    {"jitter",       TASK_CORE_BRIDGE,  13},
+    {"tcp_server",   TASK_CORE_NETWORK, 5},
+    {"udp_server",   TASK_CORE_NETWORK, 5},
+    {"schedule",     TASK_CORE_NETWORK, 5},
+    {"stm32 flash",  TASK_CORE_NETWORK, 5},
+    {"ota",          TASK_CORE_NETWORK, 5},
+    {"control",      TASK_CORE_NETWORK, 3},
+    {"I2C slave",    TASK_CORE_NETWORK, 10},
+    {"power",        TASK_CORE_NETWORK, 5},
+    {"stats",        TASK_CORE_NETWORK, 1},
+};
+
+typedef struct {
+    TaskHandle_t handle;
+    const char *name;
+    uint32_t stack_size;
+    int core;
+} task_entry_t;
+
+static task_entry_t tasks[TASKS_MAX];
+static int num_tasks = 0;
+static portMUX_TYPE tasks_lock = portMUX_INITIALIZER_UNLOCKED;
+
+
+TaskHandle_t task_create(TaskFunction_t function, const char *name, uint32_t stack_size, void *param, UBaseType_t priority)
+{
+    int core = TASK_NO_AFFINITY;
+    for (int i = 0; i < sizeof(placements) / sizeof(placements[0]); i++) {
+        if (strcmp(placements[i].name, name) == 0) {
+            core = placements[i].core;
+            priority = placements[i].priority;
+            break;
+        }
+    }
+
+    TaskHandle_t handle = NULL;
+    BaseType_t ret;
+#if CONFIG_FREERTOS_UNICORE || CONFIG_IDF_TARGET_LINUX
+    ret = xTaskCreate(function, name, stack_size, param, priority, &handle);
+#else
+    ret = xTaskCreatePinnedToCore(function, name, stack_size, param, priority, &handle,
+        core == TASK_NO_AFFINITY ? tskNO_AFFINITY : core);
+#endif
+    if (ret != pdPASS) {
+        ESP_LOGE(TAG, "Unable to create task %s", name);
+        return NULL;
+    }
+
+    taskENTER_CRITICAL(&tasks_lock);
+    if (num_tasks < TASKS_MAX) {
+        tasks[num_tasks++] = (task_entry_t){
+            .handle = handle,
+            .name = name,
+            .stack_size = stack_size,
+            .core = core,
+        };
+    }
+    taskEXIT_CRITICAL(&tasks_lock);
+    return handle;
+}
+
+int task_count(void)
+{
+    return num_tasks;
+}
+
+void task_get_stats(int index, task_stats_t *stats)
+{
+    task_entry_t *task = &tasks[index];
+    stats->name = task->name;
+    stats->core = task->core;
+    stats->priority = uxTaskPriorityGet(task->handle);
+    stats->stack_size = task->stack_size;
+    stats->stack_free_min = uxTaskGetStackHighWaterMark(task->handle) * sizeof(StackType_t);
+}
+
+static void tasks_command(int fd, int argc, char **argv)
+{
+    // cores are fixed at creation, priorities can be tried out at runtime
+    if (argc >= 4 && strcmp(argv[2], "priority") == 0) {
+        int i;
+        for (i = 0; i < num_tasks; i++) {
+            if (strcmp(tasks[i].name, argv[1]) == 0) {
+                UBaseType_t priority = strtoul(argv[3], NULL, 10);
+                vTaskPrioritySet(tasks[i].handle, MIN(priority, configMAX_PRIORITIES - 1));
+                break;
+            }
+        }
+        if (i == num_tasks) {
+            control_printf(fd, "unknown task: %s\n", argv[1]);
+        }
+    }
+
+    for (int i = 0; i < num_tasks; i++) {
+        task_stats_t stats;
+        task_get_stats(i, &stats);
+        if (stats.core == TASK_NO_AFFINITY) {
+            control_printf(fd, "%s: core=any priority=%lu\n", stats.name, (unsigned long)stats.priority);
+        } else {
+            control_printf(fd, "%s: core=%d priority=%lu\n", stats.name, stats.core, (unsigned long)stats.priority);
+        }
+    }
+}
+
+void tasks_init(void)
+{
+    control_register("tasks", "[<task> priority <n>] core and priority of every task", tasks_command);
+}
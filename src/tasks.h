@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+
+#define TASKS_MAX   20
+
+// Cores on the dual core ESP32-S3. WiFi and lwIP are pinned to core 0 (sdkconfig.defaults),
+// the USB/UART hot path gets core 1 to itself so radio bursts don't delay the stm32 link.
+#define TASK_NO_AFFINITY    (-1)
+#if CONFIG_FREERTOS_UNICORE || CONFIG_IDF_TARGET_LINUX
+#define TASK_CORE_NETWORK   TASK_NO_AFFINITY
+#define TASK_CORE_BRIDGE    TASK_NO_AFFINITY
+#else
+#define TASK_CORE_NETWORK   0
+#define TASK_CORE_BRIDGE    1
+#endif
+
+// Create a task that runs forever and remember it, so its stack usage can be reported.
+// Core and priority come from the placement table in tasks.c if the task is listed there,
+// otherwise it runs on any core at `priority`.
+TaskHandle_t task_create(TaskFunction_t function, const char *name, uint32_t stack_size, void *param, UBaseType_t priority);
+
+typedef struct {
+    const char *name;
+    int core;                   // TASK_NO_AFFINITY or the core it is pinned to
+    UBaseType_t priority;
+    uint32_t stack_size;        // bytes
+    uint32_t stack_free_min;    // bytes, lowest since the task started
+} task_stats_t;
+
+int task_count(void);
+void task_get_stats(int index, task_stats_t *stats);
+
+// registers the "tasks" control command
+void tasks_init(void);
@@ -1,20 +1,23 @@
 #include "tcp_server.h"
 
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "freertos/ringbuf.h"
-#include "driver/usb_serial_jtag.h"
 #include "sdkconfig.h"
 #include "esp_log.h"
-#include "esp_event.h"
 #include "esp_check.h"
-#include "esp_wifi.h"
-#include "nvs_flash.h"
 
-#include "lwip/err.h"
-#include "lwip/sockets.h"
-#include "lwip/sys.h"
-#include <lwip/netdb.h>
+#include "port.h"
+#include "latency.h"
+#include "control.h"
+#include "credit.h"
+#include "decimate.h"
+#include "timesync.h"
+#include "mux.h"
+#include "power.h"
+#include "tasks.h"
 
 
 #define PORT                        55533
@@ -22,28 +25,327 @@
 #define KEEPALIVE_INTERVAL          5
 #define KEEPALIVE_COUNT             3
 #define NODELAY                     1
+#define SEND_CHUNK                  1460
+// how often to retry clients whose rx buffer is full or who are owed credits, the mux doesn't wake us.
+#define THROTTLE_POLL_MS            10
 
 static const char *TAG = "tcp_server";
 
-static EventGroupHandle_t socket_event_group;
+typedef struct {
+    int sock;                   // -1 while the slot is free
+    fanout_t *rx;
+    fanout_reader_t *tx;
+    char addr[16];
+    bool tx_blocked;            // socket send buffer full, wait until writable
+    bool tx_at_boundary;        // last byte sent ended a stm32 frame, credit grants may go out
+    credit_state_t credit;
+    bool stamps;                // the client asked for uart receive timestamps
+    uint32_t last_stamp;
+    credit_msg_t stamp;         // stamp being sent
+    size_t stamp_len;           // bytes of `stamp` still to send
+    decimate_state_t decimate;
+    bool requests_done;         // past the credit and timestamp requests a client may start with
+    uint32_t rx_bytes;
+    uint32_t tx_bytes;
+    uint32_t ignored_bytes;     // sent while not allowed to
+} tcp_client_t;
+
+static tcp_client_t clients[TCP_MAX_CLIENTS];
+static volatile int num_clients = 0;
+
+static volatile tcp_policy_t policy = TCP_POLICY_FIRST_WRITER;
+static volatile int controller = -1;
+
+// telemetry arrived for some client
+static int wake_fd = -1;
+static bool wake_pending = false;
+
+static const char *policy_names[] = {
+    [TCP_POLICY_FIRST_WRITER] = "first",
+    [TCP_POLICY_DESIGNATED] = "designated",
+    [TCP_POLICY_ALL] = "all",
+};
+
+
+// called by the uart rx task after writing telemetry
+static void tcp_wake(void *arg)
+{
+    if (!__atomic_exchange_n(&wake_pending, true, __ATOMIC_ACQ_REL)) {
+        uint64_t one = 1;
+        write(wake_fd, &one, sizeof(one));
+    }
+}
+
+// claim: the client is sending right now, under first-writer it takes control if nobody has it.
+static bool tcp_client_may_send(int id, bool claim)
+{
+    switch (policy) {
+    case TCP_POLICY_ALL:
+        return true;
+    case TCP_POLICY_FIRST_WRITER:
+        if (controller < 0) {
+            if (claim) {
+                controller = id;
+            }
+            return true;
+        }
+        return controller == id;
+    case TCP_POLICY_DESIGNATED:
+    default:
+        return controller == id;
+    }
+}
+
+static void tcp_client_open(int sock, struct sockaddr_storage *source_addr)
+{
+    int id;
+    for (id = 0; id < TCP_MAX_CLIENTS; id++) {
+        if (clients[id].sock < 0) {
+            break;
+        }
+    }
+    if (id == TCP_MAX_CLIENTS) {
+        ESP_LOGW(TAG, "Too many clients");
+        close(sock);
+        return;
+    }
 
-#define SOCKET_CONNECTED_BIT BIT0
-#define SOCKET_DISCONNECTED_BIT BIT1
+    int keepAlive = 1;
+    int keepIdle = KEEPALIVE_IDLE;
+    int keepInterval = KEEPALIVE_INTERVAL;
+    int keepCount = KEEPALIVE_COUNT;
+    int noDelay = NODELAY;
+    // Set tcp keepalive option
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &keepAlive, sizeof(int));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &keepIdle, sizeof(int));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &keepInterval, sizeof(int));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &keepCount, sizeof(int));
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(int));
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+    tcp_client_t *client = &clients[id];
+    client->sock = sock;
+    client->tx_blocked = false;
+    client->tx_at_boundary = true;
+    client->credit = (credit_state_t){0};
+    client->stamps = false;
+    client->stamp_len = 0;
+    decimate_reset(&client->decimate);
+    client->requests_done = false;
+    client->rx_bytes = client->tx_bytes = client->ignored_bytes = 0;
+    client->addr[0] = 0;
+    // Convert ip address to string
+    if (source_addr->ss_family == PF_INET) {
+        inet_ntoa_r(((struct sockaddr_in *)source_addr)->sin_addr, client->addr, sizeof(client->addr) - 1);
+    }
+    ESP_LOGI(TAG, "Socket accepted ip address: %s", client->addr);
+
+    fanout_reader_attach(client->tx);
 
-static int tcp_socket_fd;
+    num_clients++;
+    power_client_connected();
+}
 
+static void tcp_client_close(int id)
+{
+    tcp_client_t *client = &clients[id];
 
+    // only hold on to telemetry while a client is connected, so a missing client never
+    // stalls the other sinks.
+    fanout_reader_detach(client->tx);
+    shutdown(client->sock, 0);
+    close(client->sock);
+    client->sock = -1;
+
+    if (controller == id) {
+        controller = -1;
+    }
+    num_clients--;
+    power_client_disconnected();
+}
+
+// send the rest of an in-band message, returns false if the socket is full or was closed.
+static bool tcp_client_send_msg(int id, const credit_msg_t *msg, size_t *pending_len)
+{
+    tcp_client_t *client = &clients[id];
+    int written = send(client->sock, (const uint8_t *)msg + sizeof(*msg) - *pending_len, *pending_len, 0);
+    if (written < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            client->tx_blocked = true;
+            return false;
+        }
+        ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
+        tcp_client_close(id);
+        return false;
+    }
+    *pending_len -= written;
+    return true;
+}
+
+// send as much pending telemetry as the socket takes without blocking
+static void tcp_client_send(int id)
+{
+    tcp_client_t *client = &clients[id];
+
+    while (!client->tx_blocked) {
+        if (client->stamp_len > 0) {
+            if (!tcp_client_send_msg(id, &client->stamp, &client->stamp_len)) {
+                return;
+            }
+            continue;
+        }
+        if (client->tx_at_boundary
+                && credit_update(&client->credit, fanout_free(client->rx), fanout_size(client->rx))) {
+            if (!tcp_client_send_msg(id, &client->credit.pending, &client->credit.pending_len)) {
+                return;
+            }
+            continue;
+        }
+
+        size_t len;
+        const uint8_t *data = fanout_read_begin(client->tx, &len, SEND_CHUNK, 0);
+        if (data == NULL) {
+            return;
+        }
+        uint32_t timestamp;
+        bool has_timestamp = fanout_read_timestamp(client->tx, &timestamp);
+
+        if (client->tx_at_boundary) {
+            // without a timestamp the client is so far behind that it is unknown
+            uint32_t age = has_timestamp ? latency_now() - timestamp : UINT32_MAX;
+            const uint8_t *end = mux_frame_end(data, len);
+            if (end && decimate_skip(&client->decimate, data, end - data + 1, age)) {
+                // a newer frame of the same kind follows
+                fanout_read_end(client->tx, end - data + 1);
+                continue;
+            }
+        }
+
+        if (client->stamps) {
+            if (client->tx_at_boundary && has_timestamp && timestamp != client->last_stamp) {
+                // when the frame that follows arrived from the stm32
+                fanout_read_end(client->tx, 0);
+                credit_msg_init(&client->stamp, TIMESYNC_MSG_STAMP, timestamp);
+                client->stamp_len = sizeof(client->stamp);
+                client->last_stamp = timestamp;
+                continue;
+            }
+            // one frame at a time, so the next one gets its own stamp
+            const uint8_t *end = mux_frame_end(data, len);
+            if (end) {
+                len = end - data + 1;
+            }
+        }
+
+        int written = send(client->sock, data, len, 0);
+        if (written < 0) {
+            fanout_read_end(client->tx, 0);
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                client->tx_blocked = true;
+                return;
+            }
+            ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
+            tcp_client_close(id);
+            return;
+        }
+        if (has_timestamp) {
+            latency_record_since(LATENCY_TCP_TX, timestamp);
+        }
+        fanout_read_end(client->tx, written);
+        client->tx_bytes += written;
+        decimate_sent(&client->decimate, written);
+        if (written > 0) {
+            client->tx_at_boundary = mux_frame_boundary(data, written);
+        }
+        // send() can return less bytes than supplied length.
+        client->tx_blocked = written < len;
+    }
+}
+
+// Credit and timestamp requests are only recognized as the very first thing a client sends.
+// Returns the number of bytes they take up.
+static size_t tcp_client_parse_requests(tcp_client_t *client, const uint8_t *data, size_t len)
+{
+    size_t skip = 0;
+    while (1) {
+        size_t n = client->credit.enabled ? 0 : credit_parse_request(&client->credit, data + skip, len - skip);
+        if (n == 0 && !client->stamps) {
+            n = credit_msg_parse(data + skip, len - skip, TIMESYNC_MSG_TAG_REQUEST, NULL);
+            client->stamps = n > 0;
+        }
+        if (n == 0) {
+            return skip;
+        }
+        skip += n;
+    }
+}
+
+// returns false if the client's rx buffer is full and the socket should not be read
+static bool tcp_client_can_receive(int id)
+{
+    size_t space;
+    return !tcp_client_may_send(id, false) || fanout_write_begin(clients[id].rx, &space, 0) != NULL;
+}
+
+// Takes the leading requests off the socket, before anything counts as sending to the stm32.
+// Returns false if there is nothing else to read yet.
+static bool tcp_client_receive_requests(tcp_client_t *client, int *len)
+{
+    uint8_t head[2 * sizeof(credit_msg_t)];
+    *len = recv(client->sock, head, sizeof(head), MSG_PEEK);
+    if (*len <= 0) {
+        return false;
+    }
+    size_t skip = tcp_client_parse_requests(client, head, *len);
+    if (skip > 0) {
+        recv(client->sock, head, skip, 0);
+    }
+    client->requests_done = skip < *len;
+    return client->requests_done;
+}
+
+static void tcp_client_receive(int id)
+{
+    tcp_client_t *client = &clients[id];
+    int len;
+
+    if (!client->requests_done && !tcp_client_receive_requests(client, &len)) {
+        // only requests so far, a listen-only client must not become the controller
+    } else if (tcp_client_may_send(id, false)) {
+        // receive straight into the rx buffer, the mux takes it from there.
+        size_t space;
+        uint8_t *dst = fanout_write_begin(client->rx, &space, 0);
+        if (dst == NULL) {
+            return;
+        }
+        len = recv(client->sock, dst, space, 0);
+        if (len > 0) {
+            tcp_client_may_send(id, true);
+            credit_received(&client->credit, len);
+            fanout_write_end(client->rx, len, latency_now());
+            client->rx_bytes += len;
+        }
+    } else {
+        char discard[128];
+        len = recv(client->sock, discard, sizeof(discard), 0);
+        if (len > 0) {
+            client->ignored_bytes += len;
+        }
+    }
+
+    if (len == 0) {
+        ESP_LOGW(TAG, "Connection closed");
+        tcp_client_close(id);
+    } else if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        ESP_LOGE(TAG, "Error occurred during receiving: errno %d", errno);
+        tcp_client_close(id);
+    }
+}
 
 static void tcp_server_task(void *pvParameters)
 {
-    char addr_str[128];
     int addr_family = (int)pvParameters;
     int ip_protocol = 0;
-    int keepAlive = 1;
-    int keepIdle = KEEPALIVE_IDLE;
-    int keepInterval = KEEPALIVE_INTERVAL;
-    int keepCount = KEEPALIVE_COUNT;
-    int noDelay = NODELAY;
     struct sockaddr_storage dest_addr;
 
     if (addr_family == AF_INET) {
@@ -73,53 +375,90 @@ static void tcp_server_task(void *pvParameters)
     }
     ESP_LOGI(TAG, "Socket bound, port %d", PORT);
 
-    err = listen(listen_sock, 1);
+    err = listen(listen_sock, TCP_MAX_CLIENTS);
     if (err != 0) {
         ESP_LOGE(TAG, "Error occurred during listen: errno %d", errno);
         goto CLEAN_UP;
     }
 
-    while (1) {
-        ESP_LOGI(TAG, "Socket listening");
+    wake_fd = port_eventfd();
+    if (wake_fd < 0) {
+        ESP_LOGE(TAG, "Unable to create eventfd: errno %d", errno);
+        goto CLEAN_UP;
+    }
+    for (int id = 0; id < TCP_MAX_CLIENTS; id++) {
+        fanout_reader_set_notify(clients[id].tx, tcp_wake, NULL);
+    }
 
-        struct sockaddr_storage source_addr; // Large enough for both IPv4 or IPv6
-        socklen_t addr_len = sizeof(source_addr);
-        int sock = accept(listen_sock, (struct sockaddr *)&source_addr, &addr_len);
-        if (sock < 0) {
-            ESP_LOGE(TAG, "Unable to accept connection: errno %d", errno);
-            break;
+    while (1) {
+        fd_set readfds, writefds;
+        FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
+        FD_SET(listen_sock, &readfds);
+        FD_SET(wake_fd, &readfds);
+        int maxfd = MAX(listen_sock, wake_fd);
+        bool throttled = false;
+
+        // telemetry written from here on wakes the select below
+        __atomic_store_n(&wake_pending, false, __ATOMIC_RELEASE);
+
+        for (int id = 0; id < TCP_MAX_CLIENTS; id++) {
+            tcp_client_t *client = &clients[id];
+            if (client->sock >= 0) {
+                tcp_client_send(id);
+            }
+            // sending may have closed it
+            if (client->sock < 0) {
+                continue;
+            }
+            if (client->tx_blocked) {
+                FD_SET(client->sock, &writefds);
+            }
+            if (tcp_client_can_receive(id)) {
+                FD_SET(client->sock, &readfds);
+            } else {
+                throttled = true;
+            }
+            if (credit_due(&client->credit, fanout_free(client->rx), fanout_size(client->rx))) {
+                // the mux doesn't wake us when it frees space, look again soon.
+                throttled = true;
+            }
+            maxfd = MAX(maxfd, client->sock);
         }
 
-        // Set tcp keepalive option
-        setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &keepAlive, sizeof(int));
-        setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &keepIdle, sizeof(int));
-        setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &keepInterval, sizeof(int));
-        setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &keepCount, sizeof(int));
-        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(int));
-        // Convert ip address to string
-        if (source_addr.ss_family == PF_INET) {
-            inet_ntoa_r(((struct sockaddr_in *)&source_addr)->sin_addr, addr_str, sizeof(addr_str) - 1);
+        int ready = port_select(maxfd + 1, &readfds, &writefds,
+            throttled ? pdMS_TO_TICKS(THROTTLE_POLL_MS) : portMAX_DELAY);
+        if (ready < 0) {
+            ESP_LOGE(TAG, "Error occurred during select: errno %d", errno);
+            vTaskDelay(pdMS_TO_TICKS(10));
+            continue;
         }
-        ESP_LOGI(TAG, "Socket accepted ip address: %s", addr_str);
-
 
-        // disable wifi modem power saving for better performance
-        ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_NONE));
-
-        tcp_socket_fd = sock;
-        xEventGroupSetBits(socket_event_group, SOCKET_CONNECTED_BIT);
-        EventBits_t bits = xEventGroupWaitBits(socket_event_group,
-            SOCKET_DISCONNECTED_BIT,
-            pdFALSE,
-            pdFALSE,
-            portMAX_DELAY);
-        xEventGroupClearBits(socket_event_group, SOCKET_DISCONNECTED_BIT);
+        if (FD_ISSET(wake_fd, &readfds)) {
+            uint64_t count;
+            read(wake_fd, &count, sizeof(count));
+        }
 
-        // enable wifi modem power saving again
-        ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_MAX_MODEM));
+        for (int id = 0; id < TCP_MAX_CLIENTS; id++) {
+            tcp_client_t *client = &clients[id];
+            if (client->sock >= 0 && FD_ISSET(client->sock, &writefds)) {
+                client->tx_blocked = false;
+            }
+            if (client->sock >= 0 && FD_ISSET(client->sock, &readfds)) {
+                tcp_client_receive(id);
+            }
+        }
 
-        shutdown(sock, 0);
-        close(sock);
+        if (FD_ISSET(listen_sock, &readfds)) {
+            struct sockaddr_storage source_addr; // Large enough for both IPv4 or IPv6
+            socklen_t addr_len = sizeof(source_addr);
+            int sock = accept(listen_sock, (struct sockaddr *)&source_addr, &addr_len);
+            if (sock < 0) {
+                ESP_LOGE(TAG, "Unable to accept connection: errno %d", errno);
+            } else {
+                tcp_client_open(sock, &source_addr);
+            }
+        }
     }
 
 CLEAN_UP:
@@ -127,90 +466,53 @@ CLEAN_UP:
     vTaskDelete(NULL);
 }
 
-
-static void tcp_rx_task(void *pvParameters)
+static void tcp_command(int fd, int argc, char **argv)
 {
-    RingbufHandle_t ringbuf = (RingbufHandle_t)pvParameters;
-
-    int len;
-    char rx_buffer[128];
-
-    while (1) {
-        // wait until socket connects
-        EventBits_t bits = xEventGroupWaitBits(socket_event_group,
-            SOCKET_CONNECTED_BIT,
-            pdFALSE,
-            pdFALSE,
-            portMAX_DELAY);
-
-        do {
-            // receive data from socket
-            len = recv(tcp_socket_fd, rx_buffer, sizeof(rx_buffer), 0);
-            if (len < 0) {
-                ESP_LOGE(TAG, "Error occurred during receiving: errno %d", errno);
-            } else if (len == 0) {
-                ESP_LOGW(TAG, "Connection closed");
-            } else {
-                // ESP_LOGI("tcp rx", "read %d bytes to tx", len);
-
-                UBaseType_t res = xRingbufferSend(ringbuf, rx_buffer, len, pdMS_TO_TICKS(1000));
-                if (res != pdTRUE) {
-                    ESP_LOGW(TAG, "Failed to send item");
-                }
+    if (argc >= 3 && strcmp(argv[1], "policy") == 0) {
+        for (int i = 0; i < sizeof(policy_names) / sizeof(policy_names[0]); i++) {
+            if (strcmp(argv[2], policy_names[i]) == 0) {
+                policy = i;
+                controller = -1;
             }
-        } while (len > 0);
-
-        xEventGroupClearBits(socket_event_group, SOCKET_CONNECTED_BIT);
-        xEventGroupSetBits(socket_event_group, SOCKET_DISCONNECTED_BIT);
+        }
+    } else if (argc >= 3 && strcmp(argv[1], "controller") == 0) {
+        controller = atoi(argv[2]);
     }
-}
-
-static void tcp_tx_task(void *pvParameters) {
-    RingbufHandle_t ringbuf = (RingbufHandle_t)pvParameters;
-
-    while (1) {
-        //Receive data from byte buffer
-        size_t item_size;
-        char *data = (char *)xRingbufferReceiveUpTo(ringbuf, &item_size, pdMS_TO_TICKS(1000), 1000);
-
-        //Check received data
-        if (data != NULL) {
-            // ESP_LOGI("tcp tx", "write %d bytes to tx", item_size);
-
-
-            // try to write the data to the socket, if connected
-            EventBits_t bits = xEventGroupGetBits(socket_event_group);
-            if ((bits & SOCKET_CONNECTED_BIT) && !(bits & SOCKET_DISCONNECTED_BIT)) {
 
-                // send() can return less bytes than supplied length.
-                // Walk-around for robust implementation.
-                int to_write = item_size;
-                while (to_write > 0) {
-                    int written = send(tcp_socket_fd, data + (item_size - to_write), to_write, 0);
-                    if (written < 0) {
-                        ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
-                        // Failed to retransmit, giving up
-                        break;
-                    }
-                    to_write -= written;
-                }
-            }
-            // else: trash data
-
-            //Return Item
-            vRingbufferReturnItem(ringbuf, (void *)data);
-        } else {
-            //Failed to receive item
-            // printf("Failed to receive item\n");
+    control_printf(fd, "policy: %s\n", policy_names[policy]);
+    control_printf(fd, "controller: %d\n", controller);
+    for (int id = 0; id < TCP_MAX_CLIENTS; id++) {
+        // racy snapshot, good enough for display
+        tcp_client_t *client = &clients[id];
+        if (client->sock >= 0) {
+            control_printf(fd, "%d: %s rx=%lu tx=%lu ignored=%lu%s%s\n", id, client->addr,
+                (unsigned long)client->rx_bytes, (unsigned long)client->tx_bytes,
+                (unsigned long)client->ignored_bytes, client->credit.enabled ? " credits" : "",
+                client->stamps ? " timestamps" : "");
+            control_printf(fd, "   drain=%luB/s decimation=1/%lu dropped=%lu\n",
+                (unsigned long)client->decimate.drain_rate, (unsigned long)client->decimate.factor,
+                (unsigned long)client->decimate.dropped);
         }
     }
 }
 
-void create_tcp_server_task(RingbufHandle_t rx_buffer, RingbufHandle_t tx_buffer)
+int tcp_server_num_clients(void)
+{
+    return num_clients;
+}
+
+void create_tcp_server_task(fanout_t *rx_buffers[TCP_MAX_CLIENTS], fanout_reader_t *tx_buffers[TCP_MAX_CLIENTS])
 {
-    socket_event_group = xEventGroupCreate();
+    for (int id = 0; id < TCP_MAX_CLIENTS; id++) {
+        clients[id].sock = -1;
+        clients[id].rx = rx_buffers[id];
+        clients[id].tx = tx_buffers[id];
+        // no client yet
+        fanout_reader_detach(tx_buffers[id]);
+    }
 
-    xTaskCreate(tcp_server_task, "tcp_server", 4096, (void*)AF_INET, 5, NULL);
-    xTaskCreate(tcp_rx_task, "tcp_rx", 4096, (void*)rx_buffer, 5, NULL);
-    xTaskCreate(tcp_tx_task, "tcp_tx", 4096, (void*)tx_buffer, 5, NULL);
-}
\ No newline at end of file
+    decimate_init();
+    control_register("tcp", "[policy first|designated|all] [controller <n>] clients and command policy", tcp_command);
+
+    task_create(tcp_server_task, "tcp_server", 4096, (void*)AF_INET, 5);
+}
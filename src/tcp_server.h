@@ -1,3 +1,20 @@
-#include "freertos/ringbuf.h"
+#pragma once
 
-void create_tcp_server_task(RingbufHandle_t rx_buffer, RingbufHandle_t tx_buffer);
\ No newline at end of file
+#include "fanout.h"
+
+#define TCP_MAX_CLIENTS     4
+
+// which clients may send to the stm32. Every client receives the full stm32 stream.
+typedef enum {
+    TCP_POLICY_FIRST_WRITER,    // the first client to send holds control until it disconnects
+    TCP_POLICY_DESIGNATED,      // only the client chosen with "tcp controller <n>" on the control port
+    TCP_POLICY_ALL,             // everyone, the mux keeps their frames apart
+} tcp_policy_t;
+
+// Serves up to TCP_MAX_CLIENTS clients from a single task.
+// Client n writes into rx_buffers[n] and reads from tx_buffers[n], which is only
+// attached while a client occupies that slot.
+void create_tcp_server_task(fanout_t *rx_buffers[TCP_MAX_CLIENTS], fanout_reader_t *tx_buffers[TCP_MAX_CLIENTS]);
+
+// connected clients, for status reports
+int tcp_server_num_clients(void);
@@ -0,0 +1,47 @@
+#include "timesync.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include "esp_timer.h"
+
+#include "control.h"
+
+volatile bool timesync_tag_udp = false;
+static uint32_t syncs = 0;
+
+
+bool timesync_reply(const uint8_t *data, size_t len, int64_t arrival, timesync_msg_t *reply)
+{
+    if (len < sizeof(timesync_msg_t) || data[0] != TIMESYNC_MSG_SYNC) {
+        return false;
+    }
+    memcpy(reply, data, sizeof(*reply));
+    reply->rx_time = arrival;
+    reply->tx_time = esp_timer_get_time();
+    syncs++;
+    return true;
+}
+
+static void timesync_command(int fd, int argc, char **argv)
+{
+    int64_t arrival = esp_timer_get_time();
+    if (argc >= 3 && strcmp(argv[1], "sync") == 0) {
+        // the same exchange as over UDP, for hosts that only have the TCP ports
+        uint64_t host_time = strtoull(argv[2], NULL, 10);
+        syncs++;
+        control_printf(fd, "host=%llu rx=%lld tx=%lld\n", (unsigned long long)host_time,
+            (long long)arrival, (long long)esp_timer_get_time());
+        return;
+    } else if (argc >= 4 && strcmp(argv[1], "tag") == 0 && strcmp(argv[2], "udp") == 0) {
+        timesync_tag_udp = strcmp(argv[3], "on") == 0;
+    }
+
+    control_printf(fd, "time: %lldus\n", (long long)arrival);
+    control_printf(fd, "syncs: %lu\n", (unsigned long)syncs);
+    control_printf(fd, "udp timestamps: %s\n", timesync_tag_udp ? "uart rx" : "send");
+}
+
+void timesync_init(void)
+{
+    control_register("clock", "[sync <host_us>|tag udp on|off] device clock sync and telemetry timestamps", timesync_command);
+}
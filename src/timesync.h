@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// The device clock for hosts: esp_timer_get_time(), microseconds since boot.
+//
+// Sync: NTP style request/response. The host sends its clock, the reply adds the device
+// clock when the request arrived and when the reply left. With the host receive time,
+//   offset = ((rx_time - host_time) + (tx_time - host_receive)) / 2
+//   delay  = (host_receive - host_time) - (tx_time - rx_time)
+// A line fitted through the offsets of the low delay exchanges gives offset and drift.
+// Served on UDP port SCHEDULE_PORT (type 'S' datagrams) and, for TCP-only hosts, by
+// "clock sync <host_us>" on the control port.
+//
+// Telemetry timestamps: stm32 data is tagged with the time the uart received it.
+// - TCP clients opt in by sending a TAG_REQUEST message (credit.h layout) as the very first
+//   thing, alone or next to a credit request. Every stm32 frame then is preceded by a STAMP
+//   message holding the low 32 bits of the device time its first bytes arrived, if that
+//   differs from the previous stamp.
+// - UDP: with "clock tag udp on" the header timestamp is the uart receive time of the first
+//   payload byte instead of the send time.
+
+#define TIMESYNC_MSG_SYNC          'S'
+#define TIMESYNC_MSG_TAG_REQUEST   'T'
+#define TIMESYNC_MSG_STAMP         'D'
+
+typedef struct __attribute__((packed)) {
+    uint8_t type;           // TIMESYNC_MSG_SYNC
+    uint8_t reserved[3];
+    uint64_t host_time;     // set by the host, echoed back
+    uint64_t rx_time;       // device clock when the request arrived, reply only
+    uint64_t tx_time;       // device clock when the reply was sent, reply only
+} timesync_msg_t;
+
+extern volatile bool timesync_tag_udp;
+
+// registers the "clock" control command
+void timesync_init(void);
+
+// Fill in the reply to a sync request that arrived at device time `arrival`.
+// Returns false if `data` is not a sync request.
+bool timesync_reply(const uint8_t *data, size_t len, int64_t arrival, timesync_msg_t *reply);
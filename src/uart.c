@@ -2,109 +2,779 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <sys/param.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
-#include "driver/uart.h"
-#include "driver/gpio.h"
-#include "soc/uart_struct.h"
-#include "soc/uart_reg.h"
+#include "freertos/semphr.h"
 #include "sdkconfig.h"
 #include "esp_log.h"
-#include "board_config.h"
+#include "esp_timer.h"
+#if CONFIG_PM_ENABLE
+#include "esp_pm.h"
+#endif
+#include "port.h"
+#include "latency.h"
+#include "control.h"
+#include "power.h"
+#include "mux.h"
+#include "tasks.h"
+#include "boot_time.h"
 
-#define BUF_SIZE (256)
+// driver rx ring buffer, holds ~20ms of telemetry at 2Mbaud so bursts don't stall the FIFO
+#define UART_RX_BUFFER_SIZE (4096)
+// defaults for the rx interrupt: after this many symbols of silence, or this many bytes in the FIFO.
+// Both can be changed with "uart rx <timeout> <threshold>".
+#define UART_RX_TIMEOUT     5
+#define UART_RX_THRESHOLD   32
+// driver tx ring buffer. Writes return once copied, the ISR refills the FIFO from it
+// back to back, and whatever is pending in the stm32 tx buffer goes out in one write.
+#define UART_TX_BUFFER_SIZE (2048)
+// start + 8 data + parity + stop
+#define UART_BITS_PER_BYTE  11
+// hardware tx FIFO behind the driver ring
+#define UART_TX_FIFO_SIZE   128
+// default bound of bulk lane data handed to the driver, in line time. An urgent frame waits
+// at most this long behind it. Can be changed with "uart tx backlog <us>".
+#define UART_TX_BACKLOG_US  20000
+// a lane that stopped in the middle of a frame keeps the line for at most this long
+#define UART_TX_FRAME_TIMEOUT_MS    20
 #define STACK_SIZE (4096 * 2)
 
 #define UART_PORT_NUM      UART_NUM_2
-#define UART_BAUD_RATE     115200
+#define UART_BAUD_RATE     115200       // stm32 bootloader rate, the link always falls back to this
+
+// High speed link, negotiated with the stm32 after boot. 0 to stay at UART_BAUD_RATE.
+#define UART_LINK_BAUD_RATE         2000000
+// hardware flow control whenever the board has the pins, lets the stm32 and esp32 pause each
+// other instead of overrunning buffers.
+#define UART_LINK_FLOW              ((FOC_UART_RTS_GPIO >= 0 && FOC_UART_CTS_GPIO >= 0) ? UART_FLOW_RTSCTS : UART_FLOW_NONE)
+// the 40MHz XTAL clock can't divide down to higher rates, those run from the APB clock
+#define UART_LINK_MAX_XTAL_BAUD     2500000
+#define UART_LINK_MAX_BAUD          4000000
+// fall back to UART_BAUD_RATE after this many framing/parity errors within the window,
+// e.g. because the stm32 reset into the bootloader.
+#define UART_LINK_ERROR_LIMIT       3
+#define UART_LINK_ERROR_WINDOW_US   100000
+#define UART_LINK_REPLY_TIMEOUT_MS  100
+#define UART_LINK_RETRY_DELAY_MS    1000
+#define UART_LINK_RETRIES           3
+
+// Handshake frame, exchanged outside of the normal stm32 protocol:
+// "FOC" <type> <baud rate, little endian> <flags> <checksum>, followed by the mux delimiter
+// so stm32 firmware that doesn't know it drops it as one bad frame.
+// 1. esp sends REQUEST at the current rate, stm32 answers ACK and both switch.
+// 2. esp sends PING at the new rate, stm32 echoes it. Otherwise the esp falls back.
+#define LINK_MSG_REQUEST    'B'
+#define LINK_MSG_ACK        'A'
+#define LINK_MSG_PING       'P'
+#define LINK_FLAG_RTSCTS    0x01
+#define LINK_FLAG_XONXOFF   0x02
+// software flow control thresholds in bytes of the rx FIFO
+#define UART_XON_THRESHOLD  32
+#define UART_XOFF_THRESHOLD 96
+
+typedef struct __attribute__((packed)) {
+    char magic[3];
+    uint8_t type;
+    uint32_t baud_rate;
+    uint8_t flags;
+    uint8_t checksum;
+} uart_link_msg_t;
 
 static const char *TAG = "uart_events";
 static QueueHandle_t uart_queue;
 
+// held by the tx task for every write, and by the handshake to keep host data off the line.
+static SemaphoreHandle_t tx_lock;
+static TaskHandle_t link_task_handle;
+
+static uint32_t link_baud_rate = UART_BAUD_RATE;
+static uart_flow_t link_flow = UART_FLOW_NONE;
+static uint32_t link_fallbacks = 0;
+static uint32_t link_drain_timeouts = 0;
+static uint32_t uart_fifo_overflows = 0;
+static uint32_t uart_buffer_full = 0;
+static uint32_t uart_parity_errors = 0;
+static uint32_t uart_frame_errors = 0;
+// tx line accounting, from the bytes written and the baud rate
+static uint32_t line_free_at;       // latency_now() time the last write will have left the FIFO
+static uint32_t tx_bytes = 0;
+static uint32_t tx_writes = 0;
+static uint32_t tx_back_to_back = 0;
+static uint32_t tx_stall_gaps = 0;
+static uint64_t tx_stall_us = 0;
+static uint64_t tx_busy_us = 0;
+static uint32_t tx_lane_timeouts = 0;
+static volatile uint32_t tx_backlog_us = UART_TX_BACKLOG_US;
+// the lane in the middle of a frame, or -1 at a frame boundary
+static int tx_lane = -1;
+static TickType_t tx_lane_since;
+// bulk data is waiting for the line to drain below the backlog bound
+static bool tx_bulk_held = false;
+static fanout_reader_t *tx_lanes[UART_TX_LANES];
+// the first write after boot is stamped in boot_time
+static bool forwarded = false;
+static uint8_t rx_timeout = UART_RX_TIMEOUT;
+static int rx_threshold = UART_RX_THRESHOLD;
+static int link_retries = 0;
+static int link_error_count = 0;
+static int64_t link_error_window_start = 0;
+#if CONFIG_PM_ENABLE
+static esp_pm_lock_handle_t link_apb_lock;
+#endif
+
+// raw access for the stm32 bootloader: received bytes stay in the driver for uart_raw_read().
+static volatile bool raw_mode = false;
+
+// while capturing, received bytes go to the handshake instead of the fanout buffer.
+static volatile bool link_capture = false;
+static uint8_t link_capture_buf[64];
+static size_t link_capture_len;
+// the negotiating task bumps link_capture_reset, the rx task empties the capture when it sees it
+static volatile uint32_t link_capture_reset;
+static volatile uint32_t link_capture_reset_done;
+static SemaphoreHandle_t link_capture_sem;
+
+
+static uint8_t link_msg_checksum(const uart_link_msg_t *msg)
+{
+    const uint8_t *bytes = (const uint8_t *)msg;
+    uint8_t sum = 0;
+    for (int i = 0; i < offsetof(uart_link_msg_t, checksum); i++) {
+        sum += bytes[i];
+    }
+    return sum;
+}
+
+static void link_send(uint8_t type, uint32_t baud_rate, uint8_t flags)
+{
+    uart_link_msg_t msg = {
+        .magic = {'F', 'O', 'C'},
+        .type = type,
+        .baud_rate = baud_rate,
+        .flags = flags,
+    };
+    msg.checksum = link_msg_checksum(&msg);
+    uart_write_bytes(UART_PORT_NUM, &msg, sizeof(msg));
+    int delimiter = mux_get_delimiter();
+    if (delimiter != MUX_NO_DELIMITER) {
+        uint8_t end = delimiter;
+        uart_write_bytes(UART_PORT_NUM, &end, 1);
+    }
+}
+
+// called from the rx task while capturing
+static void link_capture_bytes(size_t size)
+{
+    uint32_t reset = link_capture_reset;
+    if (link_capture_reset_done != reset) {
+        link_capture_len = 0;
+        link_capture_reset_done = reset;
+    }
+    while (size > 0) {
+        if (link_capture_len == sizeof(link_capture_buf)) {
+            // keep the most recent half, a reply can't be longer than that.
+            memmove(link_capture_buf, link_capture_buf + sizeof(link_capture_buf) / 2, sizeof(link_capture_buf) / 2);
+            link_capture_len = sizeof(link_capture_buf) / 2;
+        }
+        int read = uart_read_bytes(UART_PORT_NUM, link_capture_buf + link_capture_len,
+            MIN(size, sizeof(link_capture_buf) - link_capture_len), 0);
+        if (read <= 0) {
+            break;
+        }
+        link_capture_len += read;
+        size -= read;
+    }
+    xSemaphoreGive(link_capture_sem);
+}
+
+static bool link_wait_reply(uint8_t type, uint32_t baud_rate)
+{
+    TickType_t timeout = pdMS_TO_TICKS(UART_LINK_REPLY_TIMEOUT_MS);
+    TimeOut_t time_out;
+    vTaskSetTimeOutState(&time_out);
+
+    while (xTaskCheckForTimeOut(&time_out, &timeout) == pdFALSE) {
+        xSemaphoreTake(link_capture_sem, timeout);
+        if (link_capture_reset_done != link_capture_reset) {
+            // the rx task hasn't emptied the capture yet
+            continue;
+        }
+        // the stm32 may still be sending telemetry, look for the reply anywhere in the capture
+        for (int i = 0; i + sizeof(uart_link_msg_t) <= link_capture_len; i++) {
+            uart_link_msg_t msg;
+            memcpy(&msg, link_capture_buf + i, sizeof(msg));
+            if (memcmp(msg.magic, "FOC", 3) == 0 && msg.type == type
+                    && msg.baud_rate == baud_rate && msg.checksum == link_msg_checksum(&msg)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static const char *flow_names[] = {
+    [UART_FLOW_NONE] = "none",
+    [UART_FLOW_RTSCTS] = "rtscts",
+    [UART_FLOW_XONXOFF] = "xonxoff",
+};
+
+static void link_apply(uint32_t baud_rate, uart_flow_t flow)
+{
+    uart_config_t uart_config = {
+        .baud_rate = baud_rate,
+        .data_bits = UART_DATA_8_BITS,
+        .parity    = UART_PARITY_EVEN,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = flow == UART_FLOW_RTSCTS ? UART_HW_FLOWCTRL_CTS_RTS : UART_HW_FLOWCTRL_DISABLE,
+        .rx_flow_ctrl_thresh = 100,
+        // .source_clk = UART_SCLK_DEFAULT,
+        .source_clk = baud_rate > UART_LINK_MAX_XTAL_BAUD ? UART_SCLK_APB : UART_SCLK_XTAL,
+    };
+
+#if CONFIG_PM_ENABLE
+    // the APB clock must not be scaled down while the uart runs from it
+    bool had_apb = link_baud_rate > UART_LINK_MAX_XTAL_BAUD;
+    bool needs_apb = baud_rate > UART_LINK_MAX_XTAL_BAUD;
+    if (needs_apb && !had_apb) {
+        esp_pm_lock_acquire(link_apb_lock);
+    }
+#endif
+
+    ESP_ERROR_CHECK(uart_param_config(UART_PORT_NUM, &uart_config));
+    ESP_ERROR_CHECK(uart_set_sw_flow_ctrl(UART_PORT_NUM, flow == UART_FLOW_XONXOFF,
+        UART_XON_THRESHOLD, UART_XOFF_THRESHOLD));
+
+#if CONFIG_PM_ENABLE
+    if (had_apb && !needs_apb) {
+        esp_pm_lock_release(link_apb_lock);
+    }
+#endif
+
+    link_baud_rate = baud_rate;
+    link_flow = flow;
+    link_error_count = 0;
+}
+
+// Let everything written so far leave at the current rate before the baud rate changes,
+// bytes still queued would reach the stm32 re-clocked as garbage. Called with tx_lock held.
+static void link_drain_tx(void)
+{
+    // a full driver ring and FIFO, plus some slack
+    uint32_t ms = (uint64_t)(UART_TX_BUFFER_SIZE + UART_TX_FIFO_SIZE) * UART_BITS_PER_BYTE * 1000 / link_baud_rate + 10;
+    if (uart_wait_tx_done(UART_PORT_NUM, pdMS_TO_TICKS(ms)) == ESP_OK) {
+        return;
+    }
+    // Only a peer holding the line with flow control gets here. The driver has no way to
+    // drop its tx ring, so stop obeying flow control and let the ring run out.
+    link_drain_timeouts++;
+    uart_set_hw_flow_ctrl(UART_PORT_NUM, UART_HW_FLOWCTRL_DISABLE, 0);
+    uart_set_sw_flow_ctrl(UART_PORT_NUM, false, UART_XON_THRESHOLD, UART_XOFF_THRESHOLD);
+    uart_wait_tx_done(UART_PORT_NUM, pdMS_TO_TICKS(ms));
+}
+
+esp_err_t uart_link_negotiate(uint32_t baud_rate, uart_flow_t flow)
+{
+    if (baud_rate < UART_BAUD_RATE || baud_rate > UART_LINK_MAX_BAUD) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (flow == UART_FLOW_RTSCTS && (FOC_UART_RTS_GPIO < 0 || FOC_UART_CTS_GPIO < 0)) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    xSemaphoreTake(tx_lock, portMAX_DELAY);
+    link_drain_tx();
+
+    link_capture_reset++;
+    xSemaphoreTake(link_capture_sem, 0);
+    link_capture = true;
+
+    esp_err_t err = ESP_OK;
+    uint8_t flags = flow == UART_FLOW_RTSCTS ? LINK_FLAG_RTSCTS : flow == UART_FLOW_XONXOFF ? LINK_FLAG_XONXOFF : 0;
+    link_send(LINK_MSG_REQUEST, baud_rate, flags);
+    if (!link_wait_reply(LINK_MSG_ACK, baud_rate)) {
+        // stm32 firmware without support for this, stay where we are.
+        err = ESP_ERR_TIMEOUT;
+    } else {
+        link_drain_tx();
+        link_apply(baud_rate, flow);
+
+        link_capture_reset++;
+        link_send(LINK_MSG_PING, baud_rate, 0);
+        if (!link_wait_reply(LINK_MSG_PING, baud_rate)) {
+            link_drain_tx();
+            link_apply(UART_BAUD_RATE, UART_FLOW_NONE);
+            link_fallbacks++;
+            err = ESP_FAIL;
+        }
+    }
+
+    link_capture = false;
+    xSemaphoreGive(tx_lock);
+    ESP_LOGI(TAG, "link at %lu baud (%s)", (unsigned long)link_baud_rate, esp_err_to_name(err));
+    return err;
+}
+
+void uart_raw_begin(uint32_t baud_rate)
+{
+    xSemaphoreTake(tx_lock, portMAX_DELAY);
+    link_drain_tx();
+    raw_mode = true;
+    link_apply(baud_rate, UART_FLOW_NONE);
+    uart_flush_input(UART_PORT_NUM);
+}
+
+void uart_raw_write(const void *data, size_t len)
+{
+    uart_write_bytes(UART_PORT_NUM, data, len);
+}
+
+int uart_raw_read(void *data, size_t len, TickType_t timeout)
+{
+    return uart_read_bytes(UART_PORT_NUM, data, len, timeout);
+}
+
+void uart_raw_end(void)
+{
+    link_drain_tx();
+    link_apply(UART_BAUD_RATE, UART_FLOW_NONE);
+    uart_flush_input(UART_PORT_NUM);
+    raw_mode = false;
+    xSemaphoreGive(tx_lock);
+    // the stm32 application is starting up, negotiate the high speed link with it again.
+    link_retries = 0;
+    xTaskNotifyGive(link_task_handle);
+}
+
+// called from the rx task on framing/parity errors
+static void link_error(void)
+{
+    if (link_baud_rate == UART_BAUD_RATE || raw_mode) {
+        return;
+    }
+
+    int64_t now = esp_timer_get_time();
+    if (now - link_error_window_start > UART_LINK_ERROR_WINDOW_US) {
+        link_error_window_start = now;
+        link_error_count = 0;
+    }
+    if (++link_error_count >= UART_LINK_ERROR_LIMIT) {
+        // most likely the stm32 was reset and talks at the bootloader rate again.
+        xSemaphoreTake(tx_lock, portMAX_DELAY);
+        link_drain_tx();
+        link_apply(UART_BAUD_RATE, UART_FLOW_NONE);
+        xSemaphoreGive(tx_lock);
+        link_fallbacks++;
+        xTaskNotifyGive(link_task_handle);
+    }
+}
+
+// negotiates the high speed link after boot, and again after a fallback.
+static void uart_link_task(void *pvParameters)
+{
+    // give the stm32 time to boot
+    vTaskDelay(pdMS_TO_TICKS(500));
+
+    while (1) {
+        if (UART_LINK_BAUD_RATE && link_baud_rate == UART_BAUD_RATE && link_retries < UART_LINK_RETRIES) {
+            if (uart_link_negotiate(UART_LINK_BAUD_RATE, UART_LINK_FLOW) == ESP_OK) {
+                link_retries = 0;
+            } else {
+                link_retries++;
+            }
+        }
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        vTaskDelay(pdMS_TO_TICKS(UART_LINK_RETRY_DELAY_MS));
+    }
+}
+
+static void uart_command(int fd, int argc, char **argv)
+{
+    if (argc >= 3 && strcmp(argv[1], "baud") == 0) {
+        uint32_t baud_rate = strtoul(argv[2], NULL, 10);
+        uart_flow_t flow = UART_FLOW_NONE;
+        for (int i = 0; argc >= 4 && i < sizeof(flow_names) / sizeof(flow_names[0]); i++) {
+            if (strcmp(argv[3], flow_names[i]) == 0) {
+                flow = i;
+            }
+        }
+        esp_err_t err;
+        if (baud_rate == UART_BAUD_RATE && flow == UART_FLOW_NONE) {
+            // going back down needs no handshake, the stm32 falls back on framing errors too.
+            xSemaphoreTake(tx_lock, portMAX_DELAY);
+            link_drain_tx();
+            link_apply(UART_BAUD_RATE, UART_FLOW_NONE);
+            xSemaphoreGive(tx_lock);
+            err = ESP_OK;
+        } else {
+            err = uart_link_negotiate(baud_rate, flow);
+        }
+        control_printf(fd, "%s\n", esp_err_to_name(err));
+    } else if (argc >= 4 && strcmp(argv[1], "tx") == 0 && strcmp(argv[2], "backlog") == 0) {
+        tx_backlog_us = strtoul(argv[3], NULL, 10);
+    } else if (argc >= 4 && strcmp(argv[1], "rx") == 0) {
+        // lower values cut latency, higher ones the number of interrupts per byte
+        uint8_t timeout = strtoul(argv[2], NULL, 10);
+        int threshold = strtoul(argv[3], NULL, 10);
+        esp_err_t err = uart_set_rx_timeout(UART_PORT_NUM, timeout);
+        if (err == ESP_OK) {
+            rx_timeout = timeout;
+            err = uart_set_rx_full_threshold(UART_PORT_NUM, threshold);
+        }
+        if (err == ESP_OK) {
+            rx_threshold = threshold;
+        }
+        control_printf(fd, "%s\n", esp_err_to_name(err));
+    }
+
+    control_printf(fd, "baud: %lu\n", (unsigned long)link_baud_rate);
+    control_printf(fd, "flow control: %s\n", flow_names[link_flow]);
+    control_printf(fd, "rx timeout: %u symbols, rx threshold: %d bytes\n", rx_timeout, rx_threshold);
+    control_printf(fd, "fallbacks: %lu\n", (unsigned long)link_fallbacks);
+    control_printf(fd, "tx drain timeouts: %lu\n", (unsigned long)link_drain_timeouts);
+    control_printf(fd, "tx: bytes=%lu writes=%lu back_to_back=%lu busy=%llums\n",
+        (unsigned long)tx_bytes, (unsigned long)tx_writes, (unsigned long)tx_back_to_back,
+        (unsigned long long)(tx_busy_us / 1000));
+    control_printf(fd, "tx stalls (line idle with data waiting): n=%lu total=%lluus\n",
+        (unsigned long)tx_stall_gaps, (unsigned long long)tx_stall_us);
+    control_printf(fd, "tx backlog bound: %luus, lane timeouts: %lu\n",
+        (unsigned long)tx_backlog_us, (unsigned long)tx_lane_timeouts);
+    control_printf(fd, "fifo overflows: %lu\n", (unsigned long)uart_fifo_overflows);
+    control_printf(fd, "buffer full: %lu\n", (unsigned long)uart_buffer_full);
+    control_printf(fd, "parity errors: %lu\n", (unsigned long)uart_parity_errors);
+    control_printf(fd, "frame errors: %lu\n", (unsigned long)uart_frame_errors);
+}
+
+void uart_get_stats(uart_stats_t *stats)
+{
+    stats->baud_rate = link_baud_rate;
+    stats->fifo_overflows = uart_fifo_overflows;
+    stats->buffer_full = uart_buffer_full;
+    stats->parity_errors = uart_parity_errors;
+    stats->frame_errors = uart_frame_errors;
+    stats->fallbacks = link_fallbacks;
+    stats->tx_bytes = tx_bytes;
+    stats->tx_stall_gaps = tx_stall_gaps;
+}
+
+
+// move `size` bytes from the driver into the fanout buffer
+static void uart_receive(fanout_t *fanout, size_t size, TickType_t timeout)
+{
+    uint32_t timestamp = latency_now();
+    // read straight into the fanout storage, in pieces if the free region wraps around.
+    size_t remaining = size;
+    while (remaining > 0) {
+        size_t len;
+        uint8_t *dst = fanout_write_begin(fanout, &len, timeout);
+        if (dst == NULL) {
+            // leave the bytes in the driver buffer, they are picked up with the next event.
+            if (timeout) {
+                ESP_LOGE(TAG, "Failed to send item");
+            }
+            break;
+        }
+        // the bytes are in the driver buffer already, never wait here.
+        int read = uart_read_bytes(UART_PORT_NUM, dst, MIN(len, remaining), 0);
+        if (read <= 0) {
+            break;
+        }
+        fanout_write_end(fanout, read, timestamp);
+        power_stm_activity(read);
+        remaining -= read;
+    }
+}
+
+// everything but data and buffer full
+static void uart_handle_error(const uart_event_t *event)
+{
+    switch (event->type) {
+    //Event of HW FIFO overflow detected
+    case UART_FIFO_OVF:
+        // The ISR has already reset the rx FIFO, those bytes are gone. What made it into
+        // the ring buffer is fine, so keep it. Flow control avoids this.
+        ESP_LOGI(TAG, "hw fifo overflow");
+        uart_fifo_overflows++;
+        break;
+    case UART_PARITY_ERR:
+        ESP_LOGI(TAG, "Parity error");
+        uart_parity_errors++;
+        // the bootloader link reads its replies from the driver, a flush would take the
+        // ACKs it is waiting for. A corrupt reply fails that step anyway.
+        if (!raw_mode) {
+            uart_flush_input(UART_PORT_NUM);
+            xQueueReset(uart_queue);
+        }
+        link_error();
+        break;
+    case UART_FRAME_ERR:
+    case UART_BREAK:
+        ESP_LOGI(TAG, "Frame error");
+        uart_frame_errors++;
+        link_error();
+        break;
+    //Others
+    default:
+        ESP_LOGI(TAG, "uart event type: %d", event->type);
+        break;
+    }
+}
+
+// Move everything the driver holds into the fanout buffer, or the handshake capture.
+// Event sizes aren't trusted, a flush or an earlier drain may have taken those bytes already.
+static void uart_drain(fanout_t *fanout, TickType_t timeout)
+{
+    size_t buffered = 0;
+    uart_get_buffered_data_len(UART_PORT_NUM, &buffered);
+    if (buffered == 0 || raw_mode) {
+        return;
+    }
+    if (link_capture) {
+        link_capture_bytes(buffered);
+    } else {
+        uart_receive(fanout, buffered, timeout);
+    }
+}
 
 static void uart_rx_task(void *pvParameters)
 {
-    RingbufHandle_t ringbuf = (RingbufHandle_t)pvParameters;
+    fanout_t *fanout = (fanout_t *)pvParameters;
 
     uart_event_t event;
-    UBaseType_t res;
-    uint8_t* dtmp = (uint8_t*) malloc(BUF_SIZE);
     for (;;) {
         if (xQueueReceive(uart_queue, (void *)&event, (TickType_t)portMAX_DELAY)) {
-            bzero(dtmp, BUF_SIZE);
             switch (event.type) {
             case UART_DATA:
-                TRY_STATIC_ASSERT(event.size <= BUF_SIZE, "UART RX BUF too small");
                 // ESP_LOGI(TAG, "[UART DATA]: %d %i", event.size, event.timeout_flag);
-                uart_read_bytes(UART_PORT_NUM, dtmp, event.size, portMAX_DELAY);
-                res = xRingbufferSend(ringbuf, dtmp, event.size, pdMS_TO_TICKS(1000));
-                if (res != pdTRUE) {
-                    ESP_LOGE(TAG, "Failed to send item");
-                }
-                break;
-            //Event of HW FIFO overflow detected
-            case UART_FIFO_OVF:
-                ESP_LOGI(TAG, "hw fifo overflow");
-                // If fifo overflow happened, you should consider adding flow control for your application.
-                // The ISR has already reset the rx FIFO,
-                // As an example, we directly flush the rx buffer here in order to read more data.
-                uart_flush_input(UART_PORT_NUM);
-                xQueueReset(uart_queue);
                 break;
             //Event of UART ring buffer full
             case UART_BUFFER_FULL:
+                // The driver stops taking bytes from the FIFO until we read, with flow control
+                // the stm32 is paused meanwhile. Drain instead of flushing.
                 ESP_LOGI(TAG, "ring buffer full");
-                // If buffer full happened, you should consider increasing your buffer size
-                // As an example, we directly flush the rx buffer here in order to read more data.
-                uart_flush_input(UART_PORT_NUM);
-                xQueueReset(uart_queue);
-                break;
-            case UART_PARITY_ERR:
-                ESP_LOGI(TAG, "Parity error");
-                // If buffer full happened, you should consider increasing your buffer size
-                // As an example, we directly flush the rx buffer here in order to read more data.
-                uart_flush_input(UART_PORT_NUM);
-                xQueueReset(uart_queue);
+                uart_buffer_full++;
                 break;
-            //Others
             default:
-                ESP_LOGI(TAG, "uart event type: %d", event.type);
+                uart_handle_error(&event);
                 break;
             }
+            // one read for everything that arrived meanwhile, the data events queued
+            // behind this one find the driver empty.
+            uart_drain(fanout, pdMS_TO_TICKS(1000));
         }
     }
-    free(dtmp);
-    dtmp = NULL;
     vTaskDelete(NULL);
 }
 
 
+uint32_t uart_tx_backlog_us(size_t queued)
+{
+    int32_t in_driver = (int32_t)(line_free_at - latency_now());
+    return MAX(in_driver, 0) + (uint64_t)queued * UART_BITS_PER_BYTE * 1000000 / link_baud_rate;
+}
+
+// Account a write of `len` bytes starting at `now`. If the line ran dry before it although
+// the data had been waiting since before that, the gap is a stall of the tx path.
+static void uart_tx_account(size_t len, uint32_t now, bool has_timestamp, uint32_t arrived)
+{
+    if ((int32_t)(now - line_free_at) > 0) {
+        if (has_timestamp && (int32_t)(line_free_at - arrived) > 0) {
+            uint32_t gap = now - line_free_at;
+            tx_stall_gaps++;
+            tx_stall_us += gap;
+            latency_record(LATENCY_STM_TX_GAP, gap);
+        }
+        line_free_at = now;
+    } else {
+        tx_back_to_back++;
+    }
+    uint32_t busy = (uint64_t)len * UART_BITS_PER_BYTE * 1000000 / link_baud_rate;
+    line_free_at += busy;
+    tx_busy_us += busy;
+    tx_bytes += len;
+    tx_writes++;
+}
+
+// bytes of bulk data the driver may take without the backlog exceeding the bound
+static size_t uart_tx_room(void)
+{
+    uint32_t backlog = uart_tx_backlog_us(0);
+    if (backlog >= tx_backlog_us) {
+        return 0;
+    }
+    return (uint64_t)(tx_backlog_us - backlog) * link_baud_rate / (UART_BITS_PER_BYTE * 1000000);
+}
+
+// write one chunk of a lane to the stm32, returns false if there was nothing to send.
+// Chunks end at the last frame boundary they contain, so the next chunk can come from
+// another lane. A chunk without one leaves the line to this lane until the frame is done.
+static bool uart_send(int lane, size_t max_len, TickType_t lock_timeout)
+{
+    fanout_reader_t *reader = tx_lanes[lane];
+    if (lane > 0 && tx_lane != lane) {
+        // bulk lanes only start a frame while the line is nearly drained
+        size_t room = uart_tx_room();
+        if (room == 0) {
+            if (fanout_read_begin(reader, &room, 1, 0)) {
+                fanout_read_end(reader, 0);
+                tx_bulk_held = true;
+            }
+            return false;
+        }
+        max_len = MIN(max_len, room);
+    }
+
+    //Receive data from fanout buffer
+    size_t item_size;
+    const uint8_t *data = fanout_read_begin(reader, &item_size, max_len, 0);
+
+    //Check received data
+    if (data == NULL) {
+        return false;
+    }
+    // the handshake owns the line
+    if (xSemaphoreTake(tx_lock, lock_timeout) != pdTRUE) {
+        fanout_read_end(reader, 0);
+        return false;
+    }
+    // without a delimiter every chunk is a whole frame
+    int delimiter = mux_get_delimiter();
+    for (size_t i = item_size; i > 0 && delimiter != MUX_NO_DELIMITER; i--) {
+        if (data[i - 1] == delimiter) {
+            item_size = i;
+            break;
+        }
+    }
+    // ESP_LOGI("uart tx", "write %d bytes to tx", item_size);
+    uint32_t timestamp;
+    bool has_timestamp = fanout_read_timestamp(reader, &timestamp);
+
+    // Write data back to the UART
+    uart_tx_account(item_size, latency_now(), has_timestamp, timestamp);
+    uart_write_bytes(UART_PORT_NUM, (const char *) data, item_size);
+    xSemaphoreGive(tx_lock);
+    if (!forwarded) {
+        forwarded = true;
+        boot_time_mark("first byte to stm32");
+    }
+    if (delimiter == MUX_NO_DELIMITER || data[item_size - 1] == delimiter) {
+        tx_lane = -1;
+    } else {
+        tx_lane = lane;
+        tx_lane_since = xTaskGetTickCount();
+    }
+    if (has_timestamp) {
+        latency_record_since(lane == MUX_LANE_URGENT ? LATENCY_STM_TX_URGENT : LATENCY_STM_TX, timestamp);
+        if (latency_jitter_enabled) {
+            latency_record_cadence(timestamp, latency_now());
+        }
+    }
+
+    //Return Item
+    fanout_read_end(reader, item_size);
+    return true;
+}
+
+// send from the most urgent lane that has data, returns false if nothing was sent.
+static bool uart_send_lanes(size_t max_len, TickType_t lock_timeout)
+{
+    if (tx_lane >= 0) {
+        // finish the frame on the line first
+        if (uart_send(tx_lane, max_len, lock_timeout)) {
+            return true;
+        }
+        if (xTaskGetTickCount() - tx_lane_since < pdMS_TO_TICKS(UART_TX_FRAME_TIMEOUT_MS)) {
+            return false;
+        }
+        // the rest of the frame never came, the stm32 drops it at the next delimiter.
+        tx_lane = -1;
+        tx_lane_timeouts++;
+    }
+    tx_bulk_held = false;
+    for (int lane = 0; lane < UART_TX_LANES; lane++) {
+        if (uart_send(lane, max_len, lock_timeout)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void uart_tx_notify(void *arg)
+{
+    xTaskNotifyGive((TaskHandle_t)arg);
+}
+
 static void uart_tx_task(void *pvParameters) {
-    RingbufHandle_t ringbuf = (RingbufHandle_t)pvParameters;
+    for (int lane = 0; lane < UART_TX_LANES; lane++) {
+        fanout_reader_set_notify(tx_lanes[lane], uart_tx_notify, xTaskGetCurrentTaskHandle());
+    }
 
     while (1) {
-        //Receive data from byte buffer
-        size_t item_size;
-        char *data = (char *)xRingbufferReceiveUpTo(ringbuf, &item_size, pdMS_TO_TICKS(1000), 100);
+        // everything that is pending, only blocks while the driver tx buffer is full.
+        if (!uart_send_lanes(UART_TX_BUFFER_SIZE, portMAX_DELAY)) {
+            // new data leaves a notification. An unfinished frame or bulk data waiting
+            // for the line to drain are looked at again on the next tick.
+            ulTaskNotifyTake(pdTRUE, tx_lane >= 0 || tx_bulk_held ? 1 : portMAX_DELAY);
+        }
+    }
+}
 
-        //Check received data
-        if (data != NULL) {
-            // ESP_LOGI("uart tx", "write %d bytes to tx", item_size);
 
-            // Write data back to the UART
-            uart_write_bytes(UART_PORT_NUM, (const char *) data, item_size);
+// polled operation for the event loop engine, see bridge.h
 
-            //Return Item
-            vRingbufferReturnItem(ringbuf, (void *)data);
-        } else {
-            //Failed to receive item
-            // printf("Failed to receive item\n");
+static fanout_t *polled_rx_buffer;
+static bool wake_pending = false;
+
+void uart_wake(void *arg)
+{
+    if (!__atomic_exchange_n(&wake_pending, true, __ATOMIC_ACQ_REL)) {
+        // an event the driver never posts itself
+        uart_event_t event = {
+            .type = UART_EVENT_MAX,
+        };
+        if (xQueueSend(uart_queue, &event, 0) != pdTRUE) {
+            // the queue is full of events anyway, the loop is awake
+            __atomic_store_n(&wake_pending, false, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+void uart_poll_rx(TickType_t timeout)
+{
+    // anything written from here on posts a new wake event
+    __atomic_store_n(&wake_pending, false, __ATOMIC_RELEASE);
+
+    uart_event_t event;
+    while (xQueueReceive(uart_queue, &event, timeout)) {
+        timeout = 0;
+        if (event.type == UART_BUFFER_FULL) {
+            uart_buffer_full++;
+        } else if (event.type != UART_DATA && event.type != UART_EVENT_MAX) {
+            uart_handle_error(&event);
         }
     }
+
+    // data events only wake us up. Whatever doesn't fit into the rx buffer stays in the
+    // driver until the next round.
+    uart_drain(polled_rx_buffer, 0);
+}
+
+bool uart_poll_tx(void)
+{
+    // only what fits into the driver tx buffer, so uart_write_bytes() returns right away.
+    size_t space = 0;
+    uart_get_tx_buffer_free_size(UART_PORT_NUM, &space);
+    if (space == 0) {
+        return false;
+    }
+    return uart_send_lanes(space, 0);
 }
 
-void create_stm32_serial_task(RingbufHandle_t rx_buffer, RingbufHandle_t tx_buffer)
+
+static void uart_setup(void)
 {
     /* Configure parameters of an UART driver,
      * communication pins and install the driver */
@@ -118,15 +788,43 @@ void create_stm32_serial_task(RingbufHandle_t rx_buffer, RingbufHandle_t tx_buff
         .source_clk = UART_SCLK_XTAL,
     };
 
-    ESP_ERROR_CHECK(uart_driver_install(UART_PORT_NUM, BUF_SIZE * 2, 0, 20, &uart_queue, 0));
+    ESP_ERROR_CHECK(uart_driver_install(UART_PORT_NUM, UART_RX_BUFFER_SIZE, UART_TX_BUFFER_SIZE, 20, &uart_queue, 0));
     ESP_ERROR_CHECK(uart_param_config(UART_PORT_NUM, &uart_config));
 
-    ESP_ERROR_CHECK(uart_set_rx_full_threshold(UART_PORT_NUM, 32));
-    ESP_ERROR_CHECK(uart_set_rx_timeout(UART_PORT_NUM, 5));
+    ESP_ERROR_CHECK(uart_set_rx_full_threshold(UART_PORT_NUM, rx_threshold));
+    ESP_ERROR_CHECK(uart_set_rx_timeout(UART_PORT_NUM, rx_timeout));
     ESP_ERROR_CHECK(uart_enable_rx_intr(UART_PORT_NUM));
 
-    ESP_ERROR_CHECK(uart_set_pin(UART_PORT_NUM, FOC_UART_TX_GPIO, FOC_UART_RX_GPIO, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
+    ESP_ERROR_CHECK(uart_set_pin(UART_PORT_NUM, FOC_UART_TX_GPIO, FOC_UART_RX_GPIO, FOC_UART_RTS_GPIO, FOC_UART_CTS_GPIO));
+
+    tx_lock = xSemaphoreCreateMutex();
+    link_capture_sem = xSemaphoreCreateBinary();
+    assert(tx_lock);
+    assert(link_capture_sem);
+#if CONFIG_PM_ENABLE
+    ESP_ERROR_CHECK(esp_pm_lock_create(ESP_PM_APB_FREQ_MAX, 0, "uart link", &link_apb_lock));
+#endif
+    control_register("uart", "[baud <rate> [rtscts|xonxoff]|rx <timeout> <threshold>|tx backlog <us>] stm32 link state, renegotiate the link", uart_command);
+
+    link_task_handle = task_create(uart_link_task, "uart link", STACK_SIZE / 2, NULL, 5);
+}
+
+void create_stm32_serial_task(fanout_t *rx_buffer, fanout_reader_t *tx_buffer[UART_TX_LANES])
+{
+    for (int lane = 0; lane < UART_TX_LANES; lane++) {
+        tx_lanes[lane] = tx_buffer[lane];
+    }
+    uart_setup();
+
+    task_create(uart_rx_task, "uart rx task", STACK_SIZE, (void*)rx_buffer, 10);
+    task_create(uart_tx_task, "uart tx task", STACK_SIZE, NULL, 10);
+}
 
-    xTaskCreate(uart_rx_task, "uart rx task", STACK_SIZE, (void*)rx_buffer, 10, NULL);
-    xTaskCreate(uart_tx_task, "uart tx task", STACK_SIZE, (void*)tx_buffer, 10, NULL);
+void uart_init_polled(fanout_t *rx_buffer, fanout_reader_t *tx_buffer[UART_TX_LANES])
+{
+    polled_rx_buffer = rx_buffer;
+    for (int lane = 0; lane < UART_TX_LANES; lane++) {
+        tx_lanes[lane] = tx_buffer[lane];
+    }
+    uart_setup();
 }
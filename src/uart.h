@@ -1,5 +1,64 @@
-#include "freertos/ringbuf.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "fanout.h"
+
+// outgoing lanes, lane 0 is the most urgent. Same order as the mux lanes.
+#define UART_TX_LANES   2
 
 // create a task that reads/writes from stm32 main serial (bootloader enabled)
-// and puts all the bytes in a ringbuffer.
-void create_stm32_serial_task(RingbufHandle_t rx_buffer, RingbufHandle_t tx_buffer);
\ No newline at end of file
+// and writes all received bytes into a fanout buffer.
+// outgoing bytes are taken from one fanout reader per lane, the most urgent lane with data
+// first, switching lanes only between frames. Bulk lanes are only handed to the driver while
+// its backlog is below a bound, so an urgent frame never waits long behind them.
+void create_stm32_serial_task(fanout_t *rx_buffer, fanout_reader_t *tx_buffer[UART_TX_LANES]);
+
+// Event loop engine (BRIDGE_EVENT_LOOP): the same uart without its rx and tx tasks,
+// driven by the bridge loop through the functions below.
+void uart_init_polled(fanout_t *rx_buffer, fanout_reader_t *tx_buffer[UART_TX_LANES]);
+// Wait up to `timeout` for a driver event or uart_wake(), then move all received bytes
+// that fit into the rx buffer.
+void uart_poll_rx(TickType_t timeout);
+// Move one chunk from the tx lanes into the driver tx buffer, without waiting.
+// Returns false if there was nothing to send or no room for it.
+bool uart_poll_tx(void);
+// Wake up uart_poll_rx(), as fanout_notify_t. Not from an ISR.
+void uart_wake(void *arg);
+
+typedef enum {
+    UART_FLOW_NONE,
+    UART_FLOW_RTSCTS,       // only on boards that route RTS/CTS to the stm32
+    UART_FLOW_XONXOFF,      // the stm32 must escape 0x11/0x13 in its data, e.g. through the HDLC ACCM
+} uart_flow_t;
+
+// Switch the stm32 link to another baud rate and flow control.
+// Both sides must agree through a handshake, without a reply the link stays as it is.
+// The link falls back to the 115200 bootloader rate by itself when the stm32 stops answering.
+esp_err_t uart_link_negotiate(uint32_t baud_rate, uart_flow_t flow);
+
+// Exclusive raw access to the stm32 line, for its ROM bootloader (stm32_flash.h).
+// Host data is held back and received bytes are left for uart_raw_read() instead of going
+// to the rx buffer, until uart_raw_end(). The line runs at `baud_rate` 8E1 meanwhile,
+// afterwards the high speed link is negotiated again.
+void uart_raw_begin(uint32_t baud_rate);
+void uart_raw_write(const void *data, size_t len);
+// Read up to `len` bytes, waiting up to `timeout` for all of them. Returns the number read.
+int uart_raw_read(void *data, size_t len, TickType_t timeout);
+void uart_raw_end(void);
+
+typedef struct {
+    uint32_t baud_rate;
+    uint32_t fifo_overflows;    // bytes lost in hardware
+    uint32_t buffer_full;       // driver ring buffer ran full
+    uint32_t parity_errors;
+    uint32_t frame_errors;      // including breaks
+    uint32_t fallbacks;         // to the bootloader baud rate
+    uint32_t tx_bytes;
+    uint32_t tx_stall_gaps;     // the line went idle while data was waiting for it
+} uart_stats_t;
+
+void uart_get_stats(uart_stats_t *stats);
+
+// Estimated time until everything written to the driver, plus `queued` more bytes,
+// has left the line. Microseconds.
+uint32_t uart_tx_backlog_us(size_t queued);
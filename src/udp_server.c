@@ -0,0 +1,305 @@
+#include "udp_server.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+#include "esp_log.h"
+
+#include "port.h"
+#include "latency.h"
+#include "control.h"
+#include "power.h"
+#include "timesync.h"
+#include "tasks.h"
+
+
+#define PORT                        55533
+#define MAX_DATAGRAM                1472
+#define MAX_PAYLOAD                 (MAX_DATAGRAM - sizeof(udp_header_t))
+// forget the client after this long without a datagram
+#define PEER_TIMEOUT_MS             5000
+// how far back duplicates can be told apart from reordered datagrams
+#define SEQ_WINDOW                  32
+
+static const char *TAG = "udp_server";
+
+typedef struct {
+    uint32_t packets;
+    uint32_t lost;          // gaps in the sequence, minus the ones that turned up late
+    uint32_t reordered;     // arrived after a later datagram, dropped
+    uint32_t duplicates;
+    uint32_t resyncs;       // sequence jumped a whole window, e.g. the client restarted
+    uint32_t overflows;     // dropped because the rx buffer was full
+    uint32_t jitter_us;     // RFC 3550 interarrival jitter
+    uint32_t tx_packets;
+    uint32_t tx_errors;
+} udp_stats_t;
+
+static fanout_t *rx_buffer;
+static fanout_reader_t *tx_buffer;
+static int sock = -1;
+static int wake_fd = -1;
+static bool wake_pending = false;
+
+static struct sockaddr_in peer;
+static bool peer_active = false;
+static TickType_t peer_last_seen;
+
+static uint32_t rx_seq;             // highest sequence number received
+static uint32_t rx_seen;            // bit n: rx_seq - n was received
+static uint32_t rx_last_arrival;
+static uint32_t rx_last_timestamp;
+static uint32_t tx_seq;
+
+static udp_stats_t stats;
+
+
+// called by the uart rx task after writing telemetry
+static void udp_wake(void *arg)
+{
+    if (!__atomic_exchange_n(&wake_pending, true, __ATOMIC_ACQ_REL)) {
+        uint64_t one = 1;
+        write(wake_fd, &one, sizeof(one));
+    }
+}
+
+// returns false if the datagram is late or a duplicate and must be dropped
+static bool udp_accept_seq(uint32_t seq, uint32_t arrival, uint32_t timestamp)
+{
+    int32_t ahead = seq - rx_seq;
+    if (ahead >= SEQ_WINDOW || ahead <= -SEQ_WINDOW) {
+        // a client that restarted its sequence from the same port, or a jump too far to
+        // make sense of: follow it instead of dropping everything or counting it all lost.
+        stats.resyncs++;
+        rx_seq = seq;
+        rx_seen = 1;
+        rx_last_arrival = arrival;
+        rx_last_timestamp = timestamp;
+        return true;
+    }
+    if (ahead > 0) {
+        stats.lost += ahead - 1;
+        rx_seen = (rx_seen << ahead) | 1;
+        rx_seq = seq;
+        return true;
+    }
+
+    uint32_t behind = -ahead;
+    if (rx_seen & (1u << behind)) {
+        stats.duplicates++;
+    } else {
+        // it was counted as lost when the gap opened
+        rx_seen |= 1u << behind;
+        if (stats.lost > 0) {
+            stats.lost--;
+        }
+        stats.reordered++;
+    }
+    return false;
+}
+
+static void udp_update_jitter(uint32_t arrival, uint32_t timestamp)
+{
+    int32_t d = (int32_t)((arrival - rx_last_arrival) - (timestamp - rx_last_timestamp));
+    uint32_t abs_d = d < 0 ? -d : d;
+    // J += (|D| - J) / 16
+    stats.jitter_us += ((int32_t)abs_d - (int32_t)stats.jitter_us) / 16;
+    rx_last_arrival = arrival;
+    rx_last_timestamp = timestamp;
+}
+
+static void udp_receive(void)
+{
+    static uint8_t datagram[MAX_DATAGRAM];
+    struct sockaddr_in source_addr;
+    socklen_t addr_len = sizeof(source_addr);
+
+    int len = recvfrom(sock, datagram, sizeof(datagram), 0, (struct sockaddr *)&source_addr, &addr_len);
+    if (len < (int)sizeof(udp_header_t)) {
+        return;
+    }
+    uint32_t arrival = latency_now();
+    udp_header_t header;
+    memcpy(&header, datagram, sizeof(header));
+
+    bool same_peer = peer_active
+        && source_addr.sin_addr.s_addr == peer.sin_addr.s_addr
+        && source_addr.sin_port == peer.sin_port;
+    if (!same_peer) {
+        // a new client takes over, its sequence starts wherever it likes.
+        char addr_str[16];
+        inet_ntoa_r(source_addr.sin_addr, addr_str, sizeof(addr_str) - 1);
+        ESP_LOGI(TAG, "New peer %s", addr_str);
+        peer = source_addr;
+        rx_seq = header.seq - 1;
+        rx_seen = 0;
+        rx_last_arrival = arrival;
+        rx_last_timestamp = header.timestamp;
+        if (!peer_active) {
+            peer_active = true;
+            fanout_reader_attach(tx_buffer);
+            power_client_connected();
+        }
+    }
+    peer_last_seen = xTaskGetTickCount();
+    stats.packets++;
+
+    if (!udp_accept_seq(header.seq, arrival, header.timestamp)) {
+        return;
+    }
+    udp_update_jitter(arrival, header.timestamp);
+
+    size_t payload_len = len - sizeof(udp_header_t);
+    if (payload_len == 0) {
+        return;
+    }
+    // a datagram is forwarded whole or not at all, never wait for space.
+    if (fanout_free(rx_buffer) < payload_len) {
+        stats.overflows++;
+        return;
+    }
+    fanout_write(rx_buffer, datagram + sizeof(udp_header_t), payload_len, arrival, 0);
+}
+
+static void udp_send_pending(void)
+{
+    static uint8_t datagram[MAX_DATAGRAM];
+
+    while (1) {
+        size_t len;
+        const uint8_t *data = fanout_read_begin(tx_buffer, &len, MAX_PAYLOAD, 0);
+        if (data == NULL) {
+            return;
+        }
+        uint32_t timestamp;
+        bool has_timestamp = fanout_read_timestamp(tx_buffer, &timestamp);
+
+        udp_header_t header = {
+            .seq = tx_seq++,
+            .timestamp = timesync_tag_udp && has_timestamp ? timestamp : latency_now(),
+        };
+        memcpy(datagram, &header, sizeof(header));
+        memcpy(datagram + sizeof(header), data, len);
+        fanout_read_end(tx_buffer, len);
+
+        // datagrams that don't fit are dropped, the client sees the gap in the sequence.
+        int sent = sendto(sock, datagram, sizeof(header) + len, 0, (struct sockaddr *)&peer, sizeof(peer));
+        if (sent < 0) {
+            stats.tx_errors++;
+        } else {
+            stats.tx_packets++;
+            if (has_timestamp) {
+                latency_record_since(LATENCY_UDP_TX, timestamp);
+            }
+        }
+    }
+}
+
+static void udp_server_task(void *pvParameters)
+{
+    struct sockaddr_in dest_addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(PORT),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+
+    sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    if (sock < 0) {
+        ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
+        vTaskDelete(NULL);
+        return;
+    }
+    if (bind(sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) != 0) {
+        ESP_LOGE(TAG, "Socket unable to bind: errno %d", errno);
+        goto CLEAN_UP;
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+    wake_fd = port_eventfd();
+    if (wake_fd < 0) {
+        ESP_LOGE(TAG, "Unable to create eventfd: errno %d", errno);
+        goto CLEAN_UP;
+    }
+    fanout_reader_set_notify(tx_buffer, udp_wake, NULL);
+
+    while (1) {
+        fd_set readfds, writefds;
+        FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
+        FD_SET(sock, &readfds);
+        FD_SET(wake_fd, &readfds);
+
+        // telemetry written from here on wakes the select below
+        __atomic_store_n(&wake_pending, false, __ATOMIC_RELEASE);
+
+        TickType_t timeout = portMAX_DELAY;
+        if (peer_active) {
+            TickType_t idle = xTaskGetTickCount() - peer_last_seen;
+            if (idle >= pdMS_TO_TICKS(PEER_TIMEOUT_MS)) {
+                ESP_LOGI(TAG, "Peer timed out");
+                peer_active = false;
+                fanout_reader_detach(tx_buffer);
+                power_client_disconnected();
+            } else {
+                udp_send_pending();
+                timeout = pdMS_TO_TICKS(PEER_TIMEOUT_MS) - idle;
+            }
+        }
+
+        int ready = port_select(MAX(sock, wake_fd) + 1, &readfds, &writefds, timeout);
+        if (ready < 0) {
+            ESP_LOGE(TAG, "Error occurred during select: errno %d", errno);
+            vTaskDelay(pdMS_TO_TICKS(10));
+            continue;
+        }
+        if (FD_ISSET(wake_fd, &readfds)) {
+            uint64_t count;
+            read(wake_fd, &count, sizeof(count));
+        }
+        if (FD_ISSET(sock, &readfds)) {
+            udp_receive();
+        }
+    }
+
+CLEAN_UP:
+    close(sock);
+    vTaskDelete(NULL);
+}
+
+static void udp_command(int fd, int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+        memset(&stats, 0, sizeof(stats));
+        return;
+    }
+
+    if (peer_active) {
+        char addr_str[16];
+        inet_ntoa_r(peer.sin_addr, addr_str, sizeof(addr_str) - 1);
+        control_printf(fd, "peer: %s:%d\n", addr_str, ntohs(peer.sin_port));
+    } else {
+        control_printf(fd, "peer: none\n");
+    }
+    control_printf(fd, "rx: packets=%lu lost=%lu reordered=%lu duplicates=%lu resyncs=%lu overflows=%lu jitter=%luus\n",
+        (unsigned long)stats.packets, (unsigned long)stats.lost, (unsigned long)stats.reordered,
+        (unsigned long)stats.duplicates, (unsigned long)stats.resyncs, (unsigned long)stats.overflows,
+        (unsigned long)stats.jitter_us);
+    control_printf(fd, "tx: packets=%lu errors=%lu\n",
+        (unsigned long)stats.tx_packets, (unsigned long)stats.tx_errors);
+}
+
+void create_udp_server_task(fanout_t *rx, fanout_reader_t *tx)
+{
+    rx_buffer = rx;
+    tx_buffer = tx;
+
+    // no client yet
+    fanout_reader_detach(tx_buffer);
+
+    control_register("udp", "[reset] udp client and loss counters", udp_command);
+
+    task_create(udp_server_task, "udp_server", 4096, NULL, 5);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+#include "fanout.h"
+
+// Datagram transport on the same port number as the TCP server, for clients that
+// prefer fresh data over complete data. There is no retransmission: late, duplicate
+// and lost datagrams are only counted.
+//
+// Every datagram in both directions starts with this header (little endian),
+// followed by raw stm32 data. A header-only datagram is a valid keepalive.
+//
+// The client is whoever sent the last valid datagram, it receives the stm32 stream
+// until it has been silent for a few seconds.
+typedef struct __attribute__((packed)) {
+    uint32_t seq;           // incremented by one per datagram by the sender
+    uint32_t timestamp;     // sender clock in microseconds, used for the jitter estimate.
+                            // Device to host with "clock tag udp on": when the uart received the data.
+} udp_header_t;
+
+void create_udp_server_task(fanout_t *rx_buffer, fanout_reader_t *tx_buffer);
@@ -1,11 +1,28 @@
 #include "usb_serial.h"
 
+#include <stdlib.h>
+#include <sys/param.h>
+#include "port.h"
+#include "latency.h"
+#include "credit.h"
+#include "mux.h"
+#include "tasks.h"
+#include "boot_time.h"
+
 #define BUF_SIZE (1024)
 #define STACK_SIZE (4096)
+// how often to check for credits to grant while there is no telemetry
+#define CREDIT_POLL_MS (10)
+// drop telemetry the host hasn't picked up within this time, e.g. because nothing is connected.
+// The stm32 must never wait for the USB port.
+#define USB_TX_TIMEOUT_MS (20)
+
+static fanout_t *usb_rx_buffer;
+static credit_state_t credit;
 
 static void usb_rx_task(void *pvParameters)
 {
-    RingbufHandle_t ringbuf = (RingbufHandle_t)pvParameters;
+    fanout_t *fanout = (fanout_t *)pvParameters;
 
     // Configure a temporary buffer for the incoming data
     uint8_t *data = (uint8_t *) malloc(BUF_SIZE);
@@ -18,39 +35,81 @@ static void usb_rx_task(void *pvParameters)
         int len = usb_serial_jtag_read_bytes(data, BUF_SIZE, pdMS_TO_TICKS(20));
         if (len) {
             // ESP_LOGE("usb rx", "%d bytes in", len);
+            uint32_t timestamp = latency_now();
 
-            UBaseType_t res = xRingbufferSend(ringbuf, data, len, pdMS_TO_TICKS(1000));
-            if (res != pdTRUE) {
-                ESP_LOGE("usb rx", "Failed to send item");
-            }
+            size_t skip = credit_parse_request(&credit, data, len);
+            credit_received(&credit, len - skip);
+
+            // Wait as long as it takes. Meanwhile the USB endpoint fills up and NAKs the host.
+            fanout_write(fanout, data + skip, len - skip, timestamp, portMAX_DELAY);
         }
     }
 }
 
-static void usb_tx_task(void *pvParameters) {
-    RingbufHandle_t ringbuf = (RingbufHandle_t)pvParameters;
+static fanout_reader_t *usb_tx_reader;
+// credit grants only go out between stm32 frames
+static bool at_boundary = true;
+static TickType_t last_write;
+// the first write after boot is stamped in boot_time
+static bool forwarded = false;
 
-    while (1) {
-        //Receive data from byte buffer
-        size_t item_size;
-        char *data = (char *)xRingbufferReceiveUpTo(ringbuf, &item_size, pdMS_TO_TICKS(1000), 1000);
+// send a credit grant or one chunk of telemetry, returns false if there was nothing to send.
+static bool usb_send(TickType_t timeout, TickType_t write_timeout)
+{
+    if (at_boundary && credit_update(&credit, fanout_free(usb_rx_buffer), fanout_size(usb_rx_buffer))) {
+        const uint8_t *msg = (const uint8_t *)&credit.pending;
+        int written = usb_serial_jtag_write_bytes(msg + sizeof(credit.pending) - credit.pending_len,
+            credit.pending_len, write_timeout);
+        credit.pending_len -= MAX(written, 0);
+        return written > 0;
+    }
 
-        //Check received data
-        if (data != NULL) {
-            // ESP_LOGI("usb_tx", "write %d bytes to tx", item_size);
+    //Receive data from fanout buffer
+    size_t item_size;
+    const uint8_t *data = fanout_read_begin(usb_tx_reader, &item_size, 1000, timeout);
 
-            usb_serial_jtag_write_bytes((const char *) data, item_size, 20 / portTICK_PERIOD_MS);
+    //Check received data
+    if (data == NULL) {
+        //Failed to receive item
+        // printf("Failed to receive item\n");
+        return false;
+    }
+    // ESP_LOGI("usb_tx", "write %d bytes to tx", item_size);
+    uint32_t timestamp;
+    bool has_timestamp = fanout_read_timestamp(usb_tx_reader, &timestamp);
 
-            //Return Item
-            vRingbufferReturnItem(ringbuf, (void *)data);
-        } else {
-            //Failed to receive item
-            // printf("Failed to receive item\n");
+    int written = usb_serial_jtag_write_bytes((const char *) data, item_size, write_timeout);
+    if (written > 0) {
+        last_write = xTaskGetTickCount();
+        if (!forwarded) {
+            forwarded = true;
+            boot_time_mark("first byte to usb");
+        }
+        at_boundary = mux_frame_boundary(data, written);
+        if (has_timestamp) {
+            latency_record_since(LATENCY_USB_TX, timestamp);
         }
+    } else if (xTaskGetTickCount() - last_write >= pdMS_TO_TICKS(USB_TX_TIMEOUT_MS)) {
+        written = item_size;
+        at_boundary = true;
+    } else {
+        // try again later
+        written = 0;
+    }
+
+    //Return Item
+    fanout_read_end(usb_tx_reader, written);
+    return written > 0;
+}
+
+static void usb_tx_task(void *pvParameters) {
+    while (1) {
+        TickType_t timeout = credit.enabled ? pdMS_TO_TICKS(CREDIT_POLL_MS) : pdMS_TO_TICKS(1000);
+        usb_send(timeout, pdMS_TO_TICKS(USB_TX_TIMEOUT_MS));
     }
 }
 
-void create_usb_serial_task(RingbufHandle_t rx_buffer, RingbufHandle_t tx_buffer)
+static void usb_serial_setup(fanout_t *rx_buffer, fanout_reader_t *tx_buffer)
 {
     // Configure USB SERIAL JTAG
     usb_serial_jtag_driver_config_t usb_serial_jtag_config = {
@@ -58,9 +117,28 @@ void create_usb_serial_task(RingbufHandle_t rx_buffer, RingbufHandle_t tx_buffer
         .rx_buffer_size = BUF_SIZE,
     };
 
+    usb_rx_buffer = rx_buffer;
+    usb_tx_reader = tx_buffer;
     ESP_ERROR_CHECK(usb_serial_jtag_driver_install(&usb_serial_jtag_config));
     ESP_LOGI("usb_serial_jtag echo", "USB_SERIAL_JTAG init done");
 
-    xTaskCreate(usb_rx_task, "USB rx", STACK_SIZE, (void*)rx_buffer, 10, NULL);
-    xTaskCreate(usb_tx_task, "USB tx", STACK_SIZE, (void*)tx_buffer, 10, NULL);
+    // the driver has no receive notification, rx keeps its own task in both engines.
+    task_create(usb_rx_task, "USB rx", STACK_SIZE, (void*)rx_buffer, 10);
+}
+
+void create_usb_serial_task(fanout_t *rx_buffer, fanout_reader_t *tx_buffer)
+{
+    usb_serial_setup(rx_buffer, tx_buffer);
+
+    task_create(usb_tx_task, "USB tx", STACK_SIZE, NULL, 10);
+}
+
+void usb_serial_init_polled(fanout_t *rx_buffer, fanout_reader_t *tx_buffer)
+{
+    usb_serial_setup(rx_buffer, tx_buffer);
+}
+
+bool usb_serial_poll_tx(void)
+{
+    return usb_send(0, 0);
 }
@@ -1,19 +1,18 @@
 #include <stdio.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "freertos/ringbuf.h"
-#include "driver/usb_serial_jtag.h"
 #include "sdkconfig.h"
 #include "esp_log.h"
-#include "esp_event.h"
 #include "esp_check.h"
-#include "esp_wifi.h"
-#include "nvs_flash.h"
 
-#include "lwip/err.h"
-#include "lwip/sockets.h"
-#include "lwip/sys.h"
-#include <lwip/netdb.h>
+#include "fanout.h"
 
-// create a task that reads/writes from usb-serial-jtag and puts all bytes in ring buffer.
-void create_usb_serial_task(RingbufHandle_t rx_buffer, RingbufHandle_t tx_buffer);
\ No newline at end of file
+// create a task that reads/writes from usb-serial-jtag and puts all bytes in a fanout buffer.
+// outgoing bytes are taken from a fanout reader.
+void create_usb_serial_task(fanout_t *rx_buffer, fanout_reader_t *tx_buffer);
+
+// Event loop engine (BRIDGE_EVENT_LOOP): only the rx task is created,
+// the bridge loop sends through usb_serial_poll_tx().
+void usb_serial_init_polled(fanout_t *rx_buffer, fanout_reader_t *tx_buffer);
+// Send one chunk or credit grant without waiting, returns false if there was nothing to send.
+bool usb_serial_poll_tx(void);
@@ -1,6 +1,7 @@
 #include "wifi.h"
 
 #include <stdio.h>
+#include <sys/param.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/ringbuf.h"
@@ -13,15 +14,45 @@
 #include "nvs_flash.h"
 #include "esp_sleep.h"
 #include "esp_pm.h"
+#include "esp_timer.h"
 
 #include "lwip/err.h"
 #include "lwip/sockets.h"
 #include "lwip/sys.h"
 #include <lwip/netdb.h>
 
+#include "control.h"
+#include "boot_time.h"
+
+#define NVS_NAMESPACE           "wifi"
+
+// The AP of the last connection that got an IP. Connecting to it directly skips the scan.
+typedef struct {
+    uint8_t bssid[6];
+    uint8_t channel;
+} wifi_last_ap_t;
+
 static int s_retry_num = 0;
 static uint32_t ip = 0;
 
+static esp_netif_t *netif;
+static esp_timer_handle_t reconnect_timer;
+static wifi_last_ap_t connected_ap;
+// fast connect to the cached AP is in use
+static bool fast_connect = false;
+// 0 while using DHCP
+static esp_netif_ip_info_t static_ip;
+static int64_t connect_start;
+static volatile uint32_t connect_time_ms;
+static volatile uint32_t disconnects;
+static volatile uint8_t last_reason;
+static volatile bool sta_associated = false;
+// wifi_reconnect() dropped the connection itself, its disconnect event is no failure
+static volatile bool manual_disconnect = false;
+// first time since boot, for boot_time
+static bool associated = false;
+static bool got_ip = false;
+
 
 static wifi_config_t wifi_config_defaults = {
     .sta = {
@@ -41,21 +72,110 @@ static wifi_config_t wifi_config_defaults = {
 };
 
 
+static bool nvs_load(const char *key, void *data, size_t len)
+{
+    nvs_handle_t handle;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return false;
+    }
+    size_t stored = len;
+    esp_err_t err = nvs_get_blob(handle, key, data, &stored);
+    nvs_close(handle);
+    return err == ESP_OK && stored == len;
+}
+
+// data NULL erases the key
+static void nvs_store(const char *key, const void *data, size_t len)
+{
+    nvs_handle_t handle;
+    if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        return;
+    }
+    if (data) {
+        nvs_set_blob(handle, key, data, len);
+    } else {
+        nvs_erase_key(handle, key);
+    }
+    nvs_commit(handle);
+    nvs_close(handle);
+}
+
+// point the station at the cached AP, or back to a full scan
+static void wifi_use_last_ap(const wifi_last_ap_t *ap)
+{
+    wifi_config_t config = wifi_config_defaults;
+    esp_wifi_get_config(WIFI_IF_STA, &config);
+    if (ap) {
+        memcpy(config.sta.bssid, ap->bssid, sizeof(ap->bssid));
+        config.sta.bssid_set = true;
+        config.sta.channel = ap->channel;
+        config.sta.scan_method = WIFI_FAST_SCAN;
+    } else {
+        config.sta.bssid_set = false;
+        config.sta.channel = 0;
+        config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+    }
+    fast_connect = ap != NULL;
+    esp_wifi_set_config(WIFI_IF_STA, &config);
+}
+
+static void wifi_connect(void)
+{
+    connect_start = esp_timer_get_time();
+    esp_wifi_connect();
+}
+
+static void reconnect_timer_callback(void *arg)
+{
+    wifi_connect();
+}
+
+// retry after WIFI_BACKOFF_MIN_MS, doubling up to WIFI_BACKOFF_MAX_MS, forever
+static void wifi_schedule_reconnect(void)
+{
+    uint32_t delay_ms = WIFI_BACKOFF_MIN_MS << MIN(s_retry_num, 16);
+    if (delay_ms > WIFI_BACKOFF_MAX_MS) {
+        delay_ms = WIFI_BACKOFF_MAX_MS;
+    }
+    s_retry_num++;
+    esp_timer_stop(reconnect_timer);
+    esp_timer_start_once(reconnect_timer, (uint64_t)delay_ms * 1000);
+    ESP_LOGI("wifi_event", "retry to connect to the AP in %lums", (unsigned long)delay_ms);
+}
+
 static void event_handler(void* arg, esp_event_base_t event_base,
                                 int32_t event_id, void* event_data)
 {
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
-        esp_wifi_connect();
-    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-        if (s_retry_num < WIFI_CONNECT_MAXIMUM_RETRIES) {
-            esp_wifi_connect();
-            s_retry_num++;
-            ESP_LOGI("wifi_event", "retry to connect to the AP");
-        } else {
-            ESP_LOGI("wifi_event", "maximun retries exceeded");
+        wifi_connect();
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
+        wifi_event_sta_connected_t* event = (wifi_event_sta_connected_t*) event_data;
+        memcpy(connected_ap.bssid, event->bssid, sizeof(connected_ap.bssid));
+        connected_ap.channel = event->channel;
+        sta_associated = true;
+        manual_disconnect = false;
+        if (!associated) {
+            associated = true;
+            boot_time_mark("wifi associated");
         }
-        ESP_LOGI("wifi_event", "connect to the AP fail");
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
+        wifi_event_sta_disconnected_t* event = (wifi_event_sta_disconnected_t*) event_data;
+        ESP_LOGI("wifi_event", "connect to the AP fail, reason %d", event->reason);
+        sta_associated = false;
         ip = 0;
+        if (manual_disconnect && event->reason == WIFI_REASON_ASSOC_LEAVE) {
+            // wifi_reconnect() is connecting again already
+            manual_disconnect = false;
+            return;
+        }
+        last_reason = event->reason;
+        disconnects++;
+        // the cached AP may be gone or have moved channel
+        if (fast_connect && s_retry_num + 1 >= WIFI_CONNECT_MAXIMUM_RETRIES) {
+            ESP_LOGI("wifi_event", "cached AP not reachable, scanning");
+            wifi_use_last_ap(NULL);
+        }
+        wifi_schedule_reconnect();
     } else if (event_base == WIFI_EVENT) {
         ESP_LOGI("wifi_event",  "unknown event", event_id);
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
@@ -63,7 +183,82 @@ static void event_handler(void* arg, esp_event_base_t event_base,
         ESP_LOGI("wifi_event", "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
         s_retry_num = 0;
         ip = event->ip_info.ip.addr;
+        connect_time_ms = (esp_timer_get_time() - connect_start) / 1000;
+        if (!got_ip) {
+            got_ip = true;
+            boot_time_mark("wifi got ip");
+        }
+
+        wifi_last_ap_t cached;
+        if (!nvs_load("last_ap", &cached, sizeof(cached)) || memcmp(&cached, &connected_ap, sizeof(cached)) != 0) {
+            nvs_store("last_ap", &connected_ap, sizeof(connected_ap));
+        }
+    }
+}
+
+static void wifi_apply_static_ip(void)
+{
+    if (static_ip.ip.addr) {
+        esp_netif_dhcpc_stop(netif);
+        esp_netif_set_ip_info(netif, &static_ip);
+    } else {
+        esp_netif_dhcpc_start(netif);
+    }
+}
+
+static void print_ip(int fd, const char *name, uint32_t addr)
+{
+    char buf[16];
+    inet_ntop(AF_INET, &addr, buf, sizeof(buf));
+    control_printf(fd, "%s: %s\n", name, buf);
+}
+
+static void wifi_command(int fd, int argc, char **argv)
+{
+    if (argc >= 2 && strcmp(argv[1], "reconnect") == 0) {
+        wifi_reconnect();
+    } else if (argc >= 2 && strcmp(argv[1], "forget") == 0) {
+        // next connect scans all channels again
+        nvs_store("last_ap", NULL, 0);
+        wifi_use_last_ap(NULL);
+    } else if (argc >= 3 && strcmp(argv[1], "static") == 0) {
+        // wifi static <ip> <netmask> <gateway> | wifi static off, applies on the next connect
+        esp_netif_ip_info_t info = {0};
+        if (strcmp(argv[2], "off") != 0) {
+            if (argc < 5 || inet_pton(AF_INET, argv[2], &info.ip.addr) != 1
+                    || inet_pton(AF_INET, argv[3], &info.netmask.addr) != 1
+                    || inet_pton(AF_INET, argv[4], &info.gw.addr) != 1) {
+                control_printf(fd, "usage: wifi static <ip> <netmask> <gateway>|off\n");
+                return;
+            }
+        }
+        static_ip = info;
+        nvs_store("static_ip", info.ip.addr ? &info : NULL, sizeof(info));
+        wifi_apply_static_ip();
     }
+
+    print_ip(fd, "ip", ip);
+    if (static_ip.ip.addr) {
+        print_ip(fd, "static ip", static_ip.ip.addr);
+        print_ip(fd, "netmask", static_ip.netmask.addr);
+        print_ip(fd, "gateway", static_ip.gw.addr);
+    } else {
+        control_printf(fd, "static ip: off\n");
+    }
+    wifi_last_ap_t cached;
+    if (nvs_load("last_ap", &cached, sizeof(cached))) {
+        control_printf(fd, "cached ap: %02x:%02x:%02x:%02x:%02x:%02x channel %d%s\n",
+            cached.bssid[0], cached.bssid[1], cached.bssid[2], cached.bssid[3], cached.bssid[4], cached.bssid[5],
+            cached.channel, fast_connect ? "" : " (scanning)");
+    } else {
+        control_printf(fd, "cached ap: none\n");
+    }
+    wifi_ap_record_t ap;
+    if (ip && esp_wifi_sta_get_ap_info(&ap) == ESP_OK) {
+        control_printf(fd, "rssi: %d\n", ap.rssi);
+    }
+    control_printf(fd, "last connect: %lums\n", (unsigned long)connect_time_ms);
+    control_printf(fd, "disconnects: %lu last reason %d, retry %d\n", (unsigned long)disconnects, last_reason, s_retry_num);
 }
 
 void wifi_init_sta(void)
@@ -71,7 +266,14 @@ void wifi_init_sta(void)
     ESP_ERROR_CHECK(esp_netif_init());
 
     ESP_ERROR_CHECK(esp_event_loop_create_default());
-    esp_netif_create_default_wifi_sta();
+    netif = esp_netif_create_default_wifi_sta();
+
+    esp_timer_create_args_t args = {
+        .callback = reconnect_timer_callback,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "wifi reconnect",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&args, &reconnect_timer));
 
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
@@ -90,10 +292,23 @@ void wifi_init_sta(void)
                                                         &instance_got_ip));
 
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+
+    // skip the scan if the AP from last time is known, and DHCP if the address is fixed.
+    // With DHCP, CONFIG_LWIP_DHCP_RESTORE_LAST_IP requests the previous lease directly.
+    wifi_last_ap_t cached;
+    if (nvs_load("last_ap", &cached, sizeof(cached))) {
+        wifi_use_last_ap(&cached);
+    }
+    if (nvs_load("static_ip", &static_ip, sizeof(static_ip))) {
+        wifi_apply_static_ip();
+    }
+
     ESP_ERROR_CHECK(esp_wifi_start());
 
     // Set wifi power saving.
     ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_MAX_MODEM));
+
+    control_register("wifi", "[reconnect|forget|static <ip> <netmask> <gateway>|static off] connection state", wifi_command);
 }
 
 
@@ -103,6 +318,12 @@ void wifi_set_ssid(uint8_t ssid[32]) {
 
     memcpy(config.ap.ssid, ssid, 32);
     config.ap.ssid_len = 0;
+    // the cached AP belongs to the old network
+    config.sta.bssid_set = false;
+    config.sta.channel = 0;
+    config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+    fast_connect = false;
+    nvs_store("last_ap", NULL, 0);
     ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &config));
 }
 
@@ -116,12 +337,37 @@ void wifi_set_password(uint8_t password[64]) {
 
 void wifi_reconnect()
 {
-    ESP_ERROR_CHECK(esp_wifi_disconnect());
-    ESP_ERROR_CHECK(esp_wifi_connect());
+    esp_timer_stop(reconnect_timer);
     s_retry_num = 0;
+    manual_disconnect = sta_associated;
+    esp_err_t err = esp_wifi_disconnect();
+    if (err != ESP_OK) {
+        ESP_LOGW("wifi", "disconnect failed: %s", esp_err_to_name(err));
+    }
+    connect_start = esp_timer_get_time();
+    err = esp_wifi_connect();
+    if (err != ESP_OK) {
+        ESP_LOGW("wifi", "connect failed: %s", esp_err_to_name(err));
+        wifi_schedule_reconnect();
+    }
 }
 
 uint32_t wifi_get_ip()
 {
     return ip;
 }
+
+void wifi_get_status(wifi_status_t *status)
+{
+    *status = (wifi_status_t){
+        .ip = ip,
+        .associated = sta_associated,
+        .disconnects = disconnects,
+        .connect_time_ms = connect_time_ms,
+    };
+    wifi_ap_record_t ap;
+    if (status->associated && esp_wifi_sta_get_ap_info(&ap) == ESP_OK) {
+        status->rssi = ap.rssi;
+        status->channel = ap.primary;
+    }
+}
@@ -1,12 +1,29 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 
+// The last AP that gave an IP is kept in NVS and connected to without a scan. After this
+// many failed attempts with it the station scans all channels instead.
 #define WIFI_CONNECT_MAXIMUM_RETRIES  2
+// reconnect delay after a disconnect, doubled on every failed attempt
+#define WIFI_BACKOFF_MIN_MS           100
+#define WIFI_BACKOFF_MAX_MS           30000
 
 void wifi_init_sta(void);
 
 void wifi_set_ssid(uint8_t ssid[32]);
 void wifi_set_password(uint8_t password[64]);
 void wifi_reconnect();
-uint32_t wifi_get_ip();
\ No newline at end of file
+uint32_t wifi_get_ip();
+
+typedef struct {
+    uint32_t ip;                // 0 without an address
+    bool associated;
+    int8_t rssi;                // of the AP, 0 if not associated
+    uint8_t channel;
+    uint32_t disconnects;
+    uint32_t connect_time_ms;   // of the last connect
+} wifi_status_t;
+
+void wifi_get_status(wifi_status_t *status);
\ No newline at end of file